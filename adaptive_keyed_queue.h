@@ -0,0 +1,379 @@
+#ifndef ADAPTIVE_KEYED_QUEUE_H
+#define ADAPTIVE_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+#include "ring_keyed_queue.h"
+
+#include <atomic>
+#include <memory>
+#include <variant>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+enum class keyed_queue_layout {
+  list,
+  ring
+};
+
+// Operation mix seen by an adaptive_keyed_queue since construction. End
+// operations are push, pop, front and back; lookups are count and the
+// first(k) family; middle operations are pop(k) and every entry moved by
+// move_to_back; iterated counts the entries visited by for_each. keys is
+// the number of distinct keys, sampled at the last decision.
+struct adaptive_keyed_queue_stats {
+  size_t operations = 0;
+  size_t end_operations = 0;
+  size_t lookups = 0;
+  size_t middle_operations = 0;
+  size_t iterated = 0;
+  size_t keys = 0;
+  size_t decisions = 0;
+  size_t migrations = 0;
+  keyed_queue_layout layout = keyed_queue_layout::list;
+};
+
+// keyed_queue that picks its storage from its own operation mix: list
+// nodes (keyed_queue), where removals and moves in the middle are splices,
+// or a circular buffer (ring_keyed_queue), where end operations and
+// iteration run over contiguous memory but middle removals leave
+// tombstones and moves copy values.
+//
+// After every window of max(window, size()) operations the next mutation
+// counts the distinct keys and decides: ring if middle operations were
+// under 1/16 of the work (operations plus iterated entries), or under 1/8
+// when keys average four entries or more, since the ring keeps a key's
+// entries in one vector of sequence numbers where the list allocates a
+// node for each; list if over 1/4; otherwise the layout stays, so a mix
+// near a boundary does not flip back and forth. Counting keys and
+// migrating each walk the queue once, O(size()), which the window
+// amortises; a migration that fails to allocate leaves the old layout in
+// place.
+//
+// Same interface and copy-on-write sharing as keyed_queue; references
+// returned from it stay valid only until the next mutation.
+template <class K, class V, class Alloc = std::allocator<std::pair<const K, V>>>
+class adaptive_keyed_queue {
+public:
+  using list_type = keyed_queue<K, V, Alloc>;
+  using ring_type = ring_keyed_queue<K, V, Alloc>;
+
+private:
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  // The operation counts, which const readers bump too. Readers sharing a
+  // queue between threads may then each add to a count at once, so counts
+  // are relaxed atomics, loaded and stored rather than incremented: a
+  // concurrent increment can be lost, which only blurs the mix, but never
+  // races.
+  struct operation_counts {
+    std::atomic<size_t> operations{0};
+    std::atomic<size_t> end_operations{0};
+    std::atomic<size_t> lookups{0};
+    std::atomic<size_t> middle_operations{0};
+    std::atomic<size_t> iterated{0};
+
+    operation_counts() = default;
+
+    operation_counts(operation_counts const &o) noexcept {
+      *this = o;
+    }
+
+    operation_counts &operator=(operation_counts const &o) noexcept {
+      operations.store(o.operations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      end_operations.store(o.end_operations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      lookups.store(o.lookups.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      middle_operations.store(o.middle_operations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      iterated.store(o.iterated.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      return *this;
+    }
+  };
+
+  static void add(std::atomic<size_t> &c, size_t n = 1) noexcept {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  std::variant<list_type, ring_type> queue;
+  size_t window;
+  mutable operation_counts counts;
+  // Keys, decisions, migrations and the layout, changed only by mutations.
+  adaptive_keyed_queue_stats counters;
+  // Counters at the last decision.
+  adaptive_keyed_queue_stats mark;
+
+  template <class F>
+  decltype(auto) visit(F f) {
+    return std::visit(f, queue);
+  }
+
+  template <class F>
+  decltype(auto) visit(F f) const {
+    return std::visit(f, queue);
+  }
+
+  // A migration copies the queue wholesale, as a copy-on-write detach does,
+  // and counts as one for the visit budgets.
+  template <class To>
+  void migrate() noexcept {
+    KEYED_QUEUE_CLONE(size());
+    try {
+      To to(get_allocator());
+      visit([&to](auto const &q) {
+        q.for_each([&to](K const &k, V const &v) {
+          to.push(k, v);
+        });
+      });
+      queue = std::move(to);
+      ++counters.migrations;
+    }
+    catch (...) {
+    }
+  }
+
+  // Walks the keys, which, like a migration, the budgets count as a clone.
+  size_t distinct_keys() const noexcept {
+    KEYED_QUEUE_CLONE(size());
+    size_t n = 0;
+    for (auto it = k_begin(); it != k_end(); ++it)
+      ++n;
+    return n;
+  }
+
+  void tune() noexcept {
+    counters = stats();
+    size_t ops = counters.operations - mark.operations;
+    if (ops < std::max(window, size()))
+      return;
+
+    size_t work = ops + counters.iterated - mark.iterated;
+    size_t middle = counters.middle_operations - mark.middle_operations;
+    counters.keys = distinct_keys();
+    size_t ring_below = counters.keys * 4 <= size() ? 8 : 16;
+    ++counters.decisions;
+    if (middle * ring_below < work && counters.layout == keyed_queue_layout::list) {
+      migrate<ring_type>();
+    }
+    else if (middle * 4 > work && counters.layout == keyed_queue_layout::ring) {
+      migrate<list_type>();
+    }
+    counters.layout = queue.index() == 0 ? keyed_queue_layout::list : keyed_queue_layout::ring;
+    mark = counters;
+  }
+
+public:
+  class k_iterator {
+  friend class adaptive_keyed_queue;
+
+  private:
+    std::variant<typename list_type::k_iterator, typename ring_type::k_iterator> iterator;
+
+    template <class It>
+    k_iterator(It it) : iterator(it) {}
+
+  public:
+    k_iterator() {
+    }
+
+    k_iterator& operator++() noexcept {
+      std::visit([](auto &it) {
+        ++it;
+      }, iterator);
+      return *this;
+    }
+
+    bool operator==(k_iterator const &k) const noexcept {
+      return iterator == k.iterator;
+    }
+
+    bool operator!=(k_iterator const &k) const noexcept {
+      return !(*this == k);
+    }
+
+    const K& operator*() const noexcept {
+      return std::visit([](auto const &it) -> K const & {
+        return *it;
+      }, iterator);
+    }
+
+  };
+
+  explicit adaptive_keyed_queue(size_t w = 4096) : adaptive_keyed_queue(Alloc(), w) {
+  }
+
+  explicit adaptive_keyed_queue(Alloc const &a, size_t w = 4096)
+      : queue(std::in_place_index<0>, a), window(std::max<size_t>(w, 1)) {
+  }
+
+  void push(K const &k, V const &v) {
+    visit([&](auto &q) {
+      q.push(k, v);
+    });
+    add(counts.operations);
+    add(counts.end_operations);
+    tune();
+  }
+
+  void pop() {
+    if (empty())
+      keyed_queue_fail(this);
+    visit([](auto &q) {
+      q.pop();
+    });
+    add(counts.operations);
+    add(counts.end_operations);
+    tune();
+  }
+
+  void pop(K const &k) {
+    visit([&](auto &q) {
+      q.pop(k);
+    });
+    add(counts.operations);
+    add(counts.middle_operations);
+    tune();
+  }
+
+  void move_to_back(K const &k) {
+    size_t moved = visit([&](auto &q) {
+      q.move_to_back(k);
+      return q.count(k);
+    });
+    add(counts.operations);
+    add(counts.middle_operations, moved);
+    tune();
+  }
+
+  CKey_Value front() {
+    add(counts.operations);
+    add(counts.end_operations);
+    return visit([](auto &q) {
+      return q.front();
+    });
+  }
+
+  CKey_Value back() {
+    add(counts.operations);
+    add(counts.end_operations);
+    return visit([](auto &q) {
+      return q.back();
+    });
+  }
+
+  CKey_CValue front() const {
+    add(counts.operations);
+    add(counts.end_operations);
+    return visit([](auto const &q) {
+      return q.front();
+    });
+  }
+
+  CKey_CValue back() const {
+    add(counts.operations);
+    add(counts.end_operations);
+    return visit([](auto const &q) {
+      return q.back();
+    });
+  }
+
+  CKey_Value first(K const &k) {
+    add(counts.operations);
+    add(counts.lookups);
+    return visit([&](auto &q) {
+      return q.first(k);
+    });
+  }
+
+  CKey_Value last(K const &k) {
+    add(counts.operations);
+    add(counts.lookups);
+    return visit([&](auto &q) {
+      return q.last(k);
+    });
+  }
+
+  CKey_CValue first(K const &k) const {
+    add(counts.operations);
+    add(counts.lookups);
+    return visit([&](auto const &q) {
+      return q.first(k);
+    });
+  }
+
+  CKey_CValue last(K const &k) const {
+    add(counts.operations);
+    add(counts.lookups);
+    return visit([&](auto const &q) {
+      return q.last(k);
+    });
+  }
+
+  size_t size() const noexcept {
+    return visit([](auto const &q) {
+      return q.size();
+    });
+  }
+
+  bool empty() const noexcept {
+    return size() == 0;
+  }
+
+  void clear() {
+    visit([](auto &q) {
+      q.clear();
+    });
+  }
+
+  size_t count(K const &k) const {
+    add(counts.operations);
+    add(counts.lookups);
+    return visit([&](auto const &q) {
+      return q.count(k);
+    });
+  }
+
+  Alloc get_allocator() const {
+    return visit([](auto const &q) {
+      return q.get_allocator();
+    });
+  }
+
+  // Calls f(k, v) for every element, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    add(counts.operations);
+    add(counts.iterated, size());
+    visit([&f](auto const &q) {
+      q.for_each(f);
+    });
+  }
+
+  keyed_queue_layout layout() const noexcept {
+    return counters.layout;
+  }
+
+  adaptive_keyed_queue_stats stats() const noexcept {
+    adaptive_keyed_queue_stats s = counters;
+    s.operations = counts.operations.load(std::memory_order_relaxed);
+    s.end_operations = counts.end_operations.load(std::memory_order_relaxed);
+    s.lookups = counts.lookups.load(std::memory_order_relaxed);
+    s.middle_operations = counts.middle_operations.load(std::memory_order_relaxed);
+    s.iterated = counts.iterated.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  k_iterator k_begin() const noexcept {
+    return visit([](auto const &q) {
+      return k_iterator(q.k_begin());
+    });
+  }
+
+  k_iterator k_end() const noexcept {
+    return visit([](auto const &q) {
+      return k_iterator(q.k_end());
+    });
+  }
+
+};
+
+#endif /* ADAPTIVE_KEYED_QUEUE_H */
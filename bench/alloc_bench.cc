@@ -0,0 +1,244 @@
+// Heap allocations per keyed_queue operation. malloc and friends are
+// interposed (operator new reaches them too), every API is run once to warm
+// up and then measured repeating the same sequence, and the counts are
+// reported per operation for the std::allocator and arena configurations.
+//
+// Arena queues must not touch the heap in steady state: the program exits
+// with status 1 when any measured arena operation exceeds --budget
+// allocations per operation (0 by default), so it can gate a build.
+
+#include "keyed_queue.h"
+#include "keyed_queue_storage.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <functional>
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void *__libc_memalign(size_t, size_t);
+extern "C" void __libc_free(void *);
+#endif
+
+namespace {
+
+std::atomic<size_t> allocations(0);
+std::atomic<size_t> allocated_bytes(0);
+
+void note(size_t bytes) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+} // namespace
+
+#ifdef __GLIBC__
+extern "C" {
+
+void *malloc(size_t n) {
+  note(n);
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+  note(n * size);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+  note(n);
+  return __libc_realloc(p, n);
+}
+
+void *aligned_alloc(size_t align, size_t n) {
+  note(n);
+  return __libc_memalign(align, n);
+}
+
+int posix_memalign(void **p, size_t align, size_t n) {
+  note(n);
+  *p = __libc_memalign(align, n);
+  return *p == nullptr ? ENOMEM : 0;
+}
+
+void free(void *p) {
+  __libc_free(p);
+}
+
+}
+#endif
+
+namespace {
+
+struct config {
+  size_t entries = 1 << 14;
+  size_t keys = 1 << 10;
+  size_t budget = 0;
+};
+
+struct measurement {
+  size_t allocations;
+  size_t bytes;
+};
+
+measurement measure(std::function<void()> const &f) {
+  size_t count = allocations.load(std::memory_order_relaxed);
+  size_t bytes = allocated_bytes.load(std::memory_order_relaxed);
+  f();
+  return measurement{allocations.load(std::memory_order_relaxed) - count,
+                     allocated_bytes.load(std::memory_order_relaxed) - bytes};
+}
+
+template <class Queue>
+class suite {
+private:
+  config const &c;
+  char const *variant;
+  bool enforce;
+  bool failed;
+
+  // Runs f once to warm up and once measured; each run performs ops
+  // operations.
+  void check(char const *name, size_t ops, std::function<void()> const &f) {
+    f();
+    measurement m = measure(f);
+    double per_op = double(m.allocations) / ops;
+    bool over = enforce && per_op > double(c.budget);
+    failed |= over;
+    std::printf("%-10s %-22s %10.3f allocs/op %10.1f bytes/op%s\n", variant, name, per_op,
+                double(m.bytes) / ops, over ? "  OVER BUDGET" : "");
+  }
+
+public:
+  suite(config const &cfg, char const *v, bool e) : c(cfg), variant(v), enforce(e), failed(false) {
+  }
+
+  bool run(Queue prototype) {
+    // Values short enough for the small-string buffer, so that only the
+    // queue's own allocations are counted.
+    Queue q = prototype;
+    for (size_t i = 0; i < c.entries; ++i)
+      q.push(i % c.keys, std::to_string(i));
+    std::string value = "value";
+    size_t n = c.entries;
+
+    check("push existing key", n, [&] {
+      for (size_t i = 0; i < n; ++i)
+        q.push(i % c.keys, value);
+      for (size_t i = 0; i < n; ++i)
+        q.pop();
+    });
+    check("push new key", c.keys, [&] {
+      for (size_t i = 0; i < c.keys; ++i)
+        q.push(c.keys + i, value);
+      for (size_t i = 0; i < c.keys; ++i)
+        q.pop(c.keys + i);
+    });
+    check("pop", n, [&] {
+      for (size_t i = 0; i < n; ++i)
+        q.pop();
+      for (size_t i = 0; i < n; ++i)
+        q.push(i % c.keys, value);
+    });
+    check("pop(k)", n, [&] {
+      for (size_t i = 0; i < n; ++i)
+        q.pop(i % c.keys);
+      for (size_t i = 0; i < n; ++i)
+        q.push(i % c.keys, value);
+    });
+    check("move_to_back", c.keys, [&] {
+      for (size_t i = 0; i < c.keys; ++i)
+        q.move_to_back(i);
+    });
+    check("front/back", n, [&] {
+      size_t sum = 0;
+      for (size_t i = 0; i < n; ++i)
+        sum += q.front().second.size() + q.back().second.size();
+      if (sum == 0)
+        std::abort();
+    });
+    check("first/last", n, [&] {
+      size_t sum = 0;
+      for (size_t i = 0; i < n; ++i)
+        sum += q.first(i % c.keys).second.size() + q.last(i % c.keys).second.size();
+      if (sum == 0)
+        std::abort();
+    });
+    check("count", n, [&] {
+      size_t sum = 0;
+      for (size_t i = 0; i < n; ++i)
+        sum += q.count(i % c.keys);
+      if (sum == 0)
+        std::abort();
+    });
+    check("k_iterator", c.keys, [&] {
+      size_t keys = 0;
+      for (auto it = q.k_begin(); it != q.k_end(); ++it)
+        ++keys;
+      if (keys == 0)
+        std::abort();
+    });
+    check("copy", 1, [&] {
+      Queue snapshot = q;
+      if (snapshot.size() != q.size())
+        std::abort();
+    });
+    check("COW clone", 1, [&] {
+      Queue snapshot = q;
+      snapshot.push(0, value);
+      if (snapshot.size() != q.size() + 1)
+        std::abort();
+    });
+    check("transfer", c.keys, [&] {
+      Queue other = prototype;
+      other.push(0, value);
+      other.pop();
+      for (size_t i = 0; i < c.keys; ++i)
+        q.transfer(i, other);
+      for (size_t i = 0; i < c.keys; ++i)
+        other.transfer(i, q);
+    });
+    return !failed;
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  config c;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--entries") && i + 1 < argc)
+      c.entries = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--keys") && i + 1 < argc)
+      c.keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--budget") && i + 1 < argc)
+      c.budget = std::strtoull(argv[++i], nullptr, 10);
+    else {
+      std::fprintf(stderr, "usage: %s [--entries n] [--keys n] [--budget allocs-per-op]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (c.keys == 0 || c.entries < c.keys) {
+    std::fprintf(stderr, "need entries >= keys > 0\n");
+    return 2;
+  }
+
+#ifndef __GLIBC__
+  std::fprintf(stderr, "malloc interposition needs glibc; counts will read zero\n");
+#endif
+
+  using arena_alloc = arena_allocator<std::pair<const size_t, std::string>>;
+  using std_queue = keyed_queue<size_t, std::string>;
+  using arena_queue = keyed_queue<size_t, std::string, arena_alloc>;
+
+  suite<std_queue>(c, "std", false).run(std_queue());
+  bool ok = suite<arena_queue>(c, "arena", true).run(arena_queue(arena_alloc()));
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+// Writer latency while a snapshot of the queue is saved. The writer does
+// push, pop and move_to_back in a loop in three phases: with no save
+// running, while a forked child saves the queue (background_save), and
+// around a synchronous save_snapshot in the writer thread. The fork itself
+// and the synchronous save are reported separately from per-operation
+// latency.
+
+#include "keyed_queue.h"
+#include "keyed_queue_snapshot.h"
+#include "bench_util.h"
+
+#include <string>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+namespace {
+
+struct config {
+  size_t entries = 1000000;
+  size_t keys = 10000;
+  size_t value_size = 64;
+  size_t ops = 200000;
+  std::string path = "keyed_queue_bench.snapshot";
+};
+
+using queue_t = keyed_queue<size_t, std::string>;
+
+void print(char const *name, bench::histogram const &h) {
+  std::printf("  %-22s %9llu %9llu %9llu %9llu %11llu\n", name,
+              (unsigned long long) h.samples(), (unsigned long long) h.percentile(0.5),
+              (unsigned long long) h.percentile(0.99), (unsigned long long) h.percentile(0.999),
+              (unsigned long long) h.max());
+}
+
+// Runs ops writer operations, or until the background save finishes when
+// there is one, whichever is later.
+void write_load(queue_t &q, config const &c, std::mt19937_64 &rng, bench::histogram &h,
+                background_save_handle *save = nullptr) {
+  std::string value(c.value_size, 'v');
+  for (size_t i = 0; i < c.ops || (save != nullptr && !save->done()); ++i) {
+    size_t k = rng() % c.keys;
+    auto start = bench::clock::now();
+    switch (i % 3) {
+    case 0:
+      q.push(k, value);
+      break;
+    case 1:
+      q.pop();
+      break;
+    default:
+      if (q.count(k) != 0)
+        q.move_to_back(k);
+      break;
+    }
+    h.record(uint64_t(bench::elapsed_ns(start)));
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  config c;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--entries") && i + 1 < argc)
+      c.entries = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--keys") && i + 1 < argc)
+      c.keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--value-size") && i + 1 < argc)
+      c.value_size = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--ops") && i + 1 < argc)
+      c.ops = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--path") && i + 1 < argc)
+      c.path = argv[++i];
+    else {
+      std::fprintf(stderr, "usage: %s [--entries n] [--keys n] [--value-size bytes] [--ops n] [--path file]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+  if (c.keys == 0 || c.entries < c.ops) {
+    std::fprintf(stderr, "need keys > 0 and entries >= ops\n");
+    return 2;
+  }
+
+  queue_t q;
+  std::string value(c.value_size, 'v');
+  for (size_t i = 0; i < c.entries; ++i)
+    q.push(i % c.keys, value);
+  std::mt19937_64 rng(7);
+
+  bench::histogram idle, during_background, around_sync;
+  write_load(q, c, rng, idle);
+
+  auto start = bench::clock::now();
+  background_save_handle save = background_save(q, c.path);
+  double fork_ns = bench::elapsed_ns(start);
+  write_load(q, c, rng, during_background, &save);
+  double background_ns = bench::elapsed_ns(start);
+  bool background_ok = save.wait();
+
+  write_load(q, c, rng, around_sync);
+  size_t saved = q.size();
+  start = bench::clock::now();
+  bool sync_ok = save_snapshot(q, c.path);
+  double sync_ns = bench::elapsed_ns(start);
+  write_load(q, c, rng, around_sync);
+
+  queue_t loaded;
+  bool load_ok = load_snapshot(loaded, c.path) && loaded.size() == saved;
+  ::unlink(c.path.c_str());
+
+  std::printf("%zu entries, %zu keys, %zu byte values\n", c.entries, c.keys, c.value_size);
+  std::printf("  fork %.2f ms, background save %.1f ms%s, synchronous save %.1f ms%s\n",
+              fork_ns / 1e6, background_ns / 1e6, background_ok ? "" : " (failed)",
+              sync_ns / 1e6, sync_ok ? "" : " (failed)");
+  std::printf("  %-22s %9s %9s %9s %9s %11s\n", "writer ns", "count", "p50", "p99", "p99.9", "max");
+  print("no save", idle);
+  print("background save", during_background);
+  print("around sync save", around_sync);
+  if (!load_ok)
+    std::printf("  reloading the snapshot failed\n");
+  return background_ok && sync_ok && load_ok ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+inline double elapsed_ns(clock::time_point since) {
+  return std::chrono::duration<double, std::nano>(clock::now() - since).count();
+}
+
+// Keys 0..n-1 with P(k) proportional to 1 / (k + 1)^s, drawn by binary
+// search over the precomputed CDF. s = 0 gives the uniform distribution.
+class zipf_distribution {
+private:
+  std::vector<double> cdf;
+
+public:
+  zipf_distribution(size_t n, double s) : cdf(n == 0 ? 1 : n) {
+    double sum = 0;
+    for (size_t k = 0; k < cdf.size(); ++k) {
+      sum += 1.0 / std::pow(double(k + 1), s);
+      cdf[k] = sum;
+    }
+    for (auto &c : cdf)
+      c /= sum;
+  }
+
+  template <class Rng>
+  size_t operator()(Rng &rng) {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    size_t k = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    return k < cdf.size() ? k : cdf.size() - 1;
+  }
+};
+
+// Log-linear latency histogram in the manner of HdrHistogram: values below
+// 128 are exact, above that each power of two is split into 64 buckets, so
+// every recorded value is kept to within 1.6% over the whole 64-bit range.
+class histogram {
+private:
+  static const size_t linear = 128;
+  static const size_t sub_buckets = 64;
+  static const size_t bucket_count = linear + 57 * sub_buckets;
+
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t largest;
+
+  static size_t index_of(uint64_t v) {
+    if (v < linear)
+      return size_t(v);
+    unsigned shift = 63 - __builtin_clzll(v) - 6;
+    return linear + (shift - 1) * sub_buckets + size_t((v >> shift) - sub_buckets);
+  }
+
+  static uint64_t value_of(size_t i) {
+    if (i < linear)
+      return i;
+    unsigned shift = unsigned((i - linear) / sub_buckets) + 1;
+    uint64_t mantissa = (i - linear) % sub_buckets + sub_buckets;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+public:
+  histogram() : counts(bucket_count), total(0), largest(0) {
+  }
+
+  void record(uint64_t v) {
+    ++counts[index_of(v)];
+    ++total;
+    largest = std::max(largest, v);
+  }
+
+  void merge(histogram const &h) {
+    for (size_t i = 0; i < bucket_count; ++i)
+      counts[i] += h.counts[i];
+    total += h.total;
+    largest = std::max(largest, h.largest);
+  }
+
+  uint64_t samples() const noexcept {
+    return total;
+  }
+
+  uint64_t max() const noexcept {
+    return largest;
+  }
+
+  // Upper bound of the bucket holding the q-quantile, q in [0, 1].
+  uint64_t percentile(double q) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank = uint64_t(q * double(total - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::min(value_of(i), largest);
+    }
+    return largest;
+  }
+};
+
+// Keeps the optimiser from dropping the work whose result is passed in.
+template <class T>
+inline void do_not_optimize(T const &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+} // namespace bench
+
+#endif /* BENCH_UTIL_H */
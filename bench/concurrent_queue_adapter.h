@@ -0,0 +1,86 @@
+#ifndef BENCH_CONCURRENT_QUEUE_ADAPTER_H
+#define BENCH_CONCURRENT_QUEUE_ADAPTER_H
+
+#include "keyed_queue.h"
+
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace bench {
+
+// What the scalability benchmark needs from a thread-safe keyed queue.
+// Removals report whether there was anything to remove instead of
+// throwing, so failed lookups cost the same in every implementation.
+class concurrent_queue {
+public:
+  using key_type = uint64_t;
+  using value_type = uint64_t;
+
+  virtual ~concurrent_queue() {
+  }
+
+  virtual std::string name() const = 0;
+  virtual void push(key_type k, value_type v) = 0;
+  virtual bool pop() = 0;
+  virtual bool pop(key_type k) = 0;
+  virtual bool move_to_back(key_type k) = 0;
+  virtual size_t count(key_type k) = 0;
+  virtual size_t size() = 0;
+};
+
+// keyed_queue behind one global mutex.
+class mutex_keyed_queue : public concurrent_queue {
+private:
+  std::mutex mutex;
+  keyed_queue<key_type, value_type> queue;
+
+public:
+  std::string name() const override {
+    return "mutex keyed_queue";
+  }
+
+  void push(key_type k, value_type v) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push(k, v);
+  }
+
+  bool pop() override {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.empty())
+      return false;
+    queue.pop();
+    return true;
+  }
+
+  bool pop(key_type k) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.count(k) == 0)
+      return false;
+    queue.pop(k);
+    return true;
+  }
+
+  bool move_to_back(key_type k) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.count(k) == 0)
+      return false;
+    queue.move_to_back(k);
+    return true;
+  }
+
+  size_t count(key_type k) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.count(k);
+  }
+
+  size_t size() override {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+};
+
+} // namespace bench
+
+#endif /* BENCH_CONCURRENT_QUEUE_ADAPTER_H */
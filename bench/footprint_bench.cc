@@ -0,0 +1,236 @@
+// Memory footprint of keyed_queue<uint64_t, std::string> by entry count,
+// key cardinality and value size. Each configuration is built in a forked
+// child, so that resident memory starts from the same baseline every time,
+// and reported as allocator bytes (mallinfo2) and resident bytes, per entry
+// and per key.
+//
+// The per-key split comes from a second build of the same entries under a
+// single key: its bytes per entry are the cost of queue and per-key list
+// nodes, and whatever the full build takes beyond that is charged to the
+// keys (index node, per-key list header, key copy).
+//
+// A second table builds --queues small queues of a few entries each, as
+// keyed_queue and as small_keyed_queue, and reports bytes per queue. A
+// third builds queues of --url-keys distinct URL-like keys, one entry each,
+// as keyed_queue and as compact_keyed_queue, and reports bytes per key.
+
+#include "keyed_queue.h"
+#include "small_keyed_queue.h"
+#include "compact_keyed_queue.h"
+
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace {
+
+struct config {
+  size_t max_entries = 1000000;
+  size_t max_keys = 100000;
+  std::vector<size_t> value_sizes = {8, 64, 256};
+  size_t queues = 100000;
+  size_t url_keys = 1000000;
+};
+
+struct footprint {
+  double heap;
+  double resident;
+};
+
+size_t heap_bytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 m = mallinfo2();
+  return m.uordblks + m.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+size_t resident_bytes() {
+  FILE *f = std::fopen("/proc/self/statm", "r");
+  if (f == nullptr)
+    return 0;
+  unsigned long pages = 0, resident = 0;
+  int n = std::fscanf(f, "%lu %lu", &pages, &resident);
+  std::fclose(f);
+  return n == 2 ? resident * size_t(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+// Runs build(take) in a child process and returns what it took by the time
+// build calls take(); build returns false if what it built is wrong.
+template <class Build>
+bool measure(Build build, footprint &out) {
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    size_t heap = heap_bytes();
+    size_t resident = resident_bytes();
+    footprint f = {0, 0};
+    bool built = build([&] {
+      f = {double(heap_bytes() - heap), double(resident_bytes() - resident)};
+    });
+    bool ok = write(fds[1], &f, sizeof(f)) == ssize_t(sizeof(f));
+    _exit(ok && built ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool ok = read(fds[0], &out, sizeof(out)) == ssize_t(sizeof(out));
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bool measure(size_t entries, size_t keys, size_t value_size, footprint &out) {
+  return measure([=](auto take) {
+    std::string value(value_size, 'v');
+    keyed_queue<uint64_t, std::string> q;
+    for (size_t i = 0; i < entries; ++i)
+      q.push(i % keys, value);
+    take();
+    return q.size() == entries;
+  }, out);
+}
+
+// n queues of the given size over at most four keys, with 8 byte values;
+// the bytes include the queue objects themselves.
+template <class Queue>
+bool measure_many(size_t n, size_t entries, footprint &out) {
+  return measure([=](auto take) {
+    std::vector<Queue> queues(n);
+    for (auto &q : queues)
+      for (size_t i = 0; i < entries; ++i)
+        q.push(i % 4, i);
+    take();
+    return queues.back().size() == entries;
+  }, out);
+}
+
+void run_many(config const &c) {
+  std::printf("\n%11s %9s %18s %18s\n", "queues", "entries", "keyed_queue B/q", "small B/q");
+  for (size_t entries : {1, 4, 16, 64}) {
+    footprint plain, small;
+    if (!measure_many<keyed_queue<uint64_t, uint64_t>>(c.queues, entries, plain) ||
+        !measure_many<small_keyed_queue<uint64_t, uint64_t>>(c.queues, entries, small)) {
+      std::fprintf(stderr, "%zu queues of %zu entries: build failed\n", c.queues, entries);
+      return;
+    }
+    std::printf("%11zu %9zu %18.1f %18.1f\n", c.queues, entries, plain.heap / double(c.queues),
+                small.heap / double(c.queues));
+  }
+}
+
+// Keys sorted apart from their numbering, so that neighbours share most of
+// their bytes, as paths under a few hosts do.
+std::string url_key(size_t i) {
+  static char const *const hosts[] = {"https://www.example.com/", "https://static.example.org/",
+                                      "https://api.example.net/v2/"};
+  return std::string(hosts[i % 3]) + "catalog/items/" + std::to_string(i / 3 % 1000) +
+         "/details/" + std::to_string(i / 3000) + ".html";
+}
+
+template <class Queue>
+bool measure_urls(size_t keys, footprint &out) {
+  return measure([=](auto take) {
+    Queue q;
+    for (size_t i = 0; i < keys; ++i)
+      q.push(url_key(i), i);
+    take();
+    return q.size() == keys && q.count(url_key(keys / 2)) == 1;
+  }, out);
+}
+
+void run_urls(config const &c) {
+  footprint plain, compact;
+  if (!measure_urls<keyed_queue<std::string, uint64_t>>(c.url_keys, plain) ||
+      !measure_urls<compact_keyed_queue<uint64_t>>(c.url_keys, compact)) {
+    std::fprintf(stderr, "%zu URL keys: build failed\n", c.url_keys);
+    return;
+  }
+  std::printf("\n%11s %18s %18s\n", "URL keys", "keyed_queue B/key", "compact B/key");
+  std::printf("%11zu %18.1f %18.1f\n", c.url_keys, plain.heap / double(c.url_keys),
+              compact.heap / double(c.url_keys));
+}
+
+void run(config const &c) {
+  std::printf("%11s %9s %6s %13s %13s %11s %11s %13s\n", "entries", "keys", "value",
+              "heap MiB", "RSS MiB", "heap/entry", "RSS/entry", "heap/key");
+
+  for (size_t value_size : c.value_sizes)
+    for (size_t entries = 1; entries <= c.max_entries; entries *= 10) {
+      footprint single;
+      if (!measure(entries, 1, value_size, single)) {
+        std::fprintf(stderr, "%zu entries: build failed\n", entries);
+        return;
+      }
+      for (size_t keys = 1; keys <= std::min(entries, c.max_keys); keys *= 10) {
+        footprint f = single;
+        if (keys != 1 && !measure(entries, keys, value_size, f)) {
+          std::fprintf(stderr, "%zu entries, %zu keys: build failed\n", entries, keys);
+          return;
+        }
+        double per_key = (f.heap - single.heap) / double(keys);
+        std::printf("%11zu %9zu %6zu %13.1f %13.1f %11.1f %11.1f %13.1f\n", entries, keys,
+                    value_size, f.heap / (1 << 20), f.resident / (1 << 20), f.heap / double(entries),
+                    f.resident / double(entries), per_key);
+      }
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  config c;
+  std::vector<size_t> value_sizes;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--max-entries") && i + 1 < argc)
+      c.max_entries = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--max-keys") && i + 1 < argc)
+      c.max_keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--url-keys") && i + 1 < argc)
+      c.url_keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--queues") && i + 1 < argc)
+      c.queues = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--value-size") && i + 1 < argc)
+      value_sizes.push_back(std::strtoull(argv[++i], nullptr, 10));
+    else {
+      std::fprintf(stderr, "usage: %s [--max-entries n] [--max-keys n] [--value-size bytes]... [--queues n] [--url-keys n]\n"
+                           "counts go up by factors of ten, e.g. --max-entries 100000000 --max-keys 10000000\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+  if (!value_sizes.empty())
+    c.value_sizes = value_sizes;
+
+#if !defined(__GLIBC__) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 33)
+  std::fprintf(stderr, "mallinfo2 needs glibc 2.33; heap columns will read zero\n");
+#endif
+
+  run(c);
+  if (c.queues != 0)
+    run_many(c);
+  if (c.url_keys != 0)
+    run_urls(c);
+  return 0;
+}
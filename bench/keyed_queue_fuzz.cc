@@ -0,0 +1,379 @@
+// Model-based fuzzer for keyed_queue. Each input byte string is decoded
+// into a sequence of operations that run against a keyed_queue and a plain
+// vector of (key, value) pairs at the same time. After every operation the
+// queue is compared with its model: size, front, back, first(k), last(k)
+// and count(k) for every key, the k_iterator order and the elements in
+// queue order. Snapshots taken along the way, plain copies of both queue
+// and model, are compared too, so a copy-on-write detach that leaks a write
+// into another copy is caught at the operation that caused it.
+//
+// Built with -DKEYED_QUEUE_COUNT_VISITS, every operation's element visits
+// and key comparisons are also checked against its asymptotic budget
+// (bench::visit_budget), so an accidental O(n) path is a failure too.
+//
+//   keyed_queue_fuzz [--runs n] [--length n] [--seed n]
+//
+// runs random inputs, for integer and string keys, and aborts with a
+// message at the first mismatch. Built with -DKEYED_QUEUE_LIBFUZZER and
+// -fsanitize=fuzzer it is a libFuzzer target instead:
+//
+//   clang++ -std=c++17 -O1 -fsanitize=fuzzer,address -DKEYED_QUEUE_LIBFUZZER -I. bench/keyed_queue_fuzz.cc
+
+#include "keyed_queue.h"
+#include "visit_budget.h"
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+
+const size_t key_range = 12;
+const size_t max_snapshots = 4;
+
+// Integer keys, and string keys that exercise the 8 byte prefix in the
+// index: short keys, keys of exactly 8 bytes and long keys that only
+// differ after a shared prefix.
+struct int_keys {
+  using type = int;
+
+  static int make(size_t i) {
+    return int(i) * 7 - 20;
+  }
+};
+
+struct string_keys {
+  using type = std::string;
+
+  static std::string make(size_t i) {
+    static char const *const keys[key_range] = {
+      "", "a", "ab", "abcdefg", "abcdefgh", "abcdefgh\0", "abcdefghi", "abcdefghij",
+      "abcdefgi", "b", "shared/prefix/long/key/1", "shared/prefix/long/key/2"
+    };
+    return std::string(keys[i], i == 5 ? 9 : std::strlen(keys[i]));
+  }
+};
+
+class input {
+private:
+  uint8_t const *data;
+  size_t size;
+
+public:
+  input(uint8_t const *d, size_t n) : data(d), size(n) {
+  }
+
+  bool empty() const {
+    return size == 0;
+  }
+
+  uint8_t byte() {
+    if (size == 0)
+      return 0;
+    --size;
+    return *data++;
+  }
+};
+
+[[noreturn]] void mismatch(size_t step, char const *what) {
+  std::fprintf(stderr, "keyed_queue_fuzz: mismatch at operation %zu: %s\n", step, what);
+  std::abort();
+}
+
+template <class Keys>
+class fuzz_run {
+private:
+  using K = typename Keys::type;
+  using queue_t = keyed_queue<K, int>;
+  using model_t = std::vector<std::pair<K, int>>;
+
+  struct copy_t {
+    queue_t queue;
+    model_t model;
+  };
+
+  queue_t queue;
+  model_t model;
+  std::vector<copy_t> snapshots;
+  size_t step = 0;
+
+  void expect(bool condition, char const *what) const {
+    if (!condition)
+      mismatch(step, what);
+  }
+
+  template <class M>
+  static auto last_of(M &m, K const &k) {
+    auto it = std::find_if(m.rbegin(), m.rend(), [&k](std::pair<K, int> const &e) {
+      return e.first == k;
+    });
+    return it == m.rend() ? m.end() : std::prev(it.base());
+  }
+
+  template <class M>
+  static auto first_of(M &m, K const &k) {
+    return std::find_if(m.begin(), m.end(), [&k](std::pair<K, int> const &e) {
+      return e.first == k;
+    });
+  }
+
+  static bool has_key(std::pair<K, int> const &e, K const &k) {
+    return e.first == k;
+  }
+
+  // The operation must throw lookup_error; run() then checks that the
+  // queue is as it was.
+  template <class F>
+  void expect_failure(F f) {
+    try {
+      f();
+    }
+    catch (lookup_error &) {
+      return;
+    }
+    expect(false, "missing lookup_error");
+  }
+
+  void check(queue_t const &q, model_t const &m) const {
+    expect(q.size() == m.size(), "size");
+    expect(q.empty() == m.empty(), "empty");
+    if (!m.empty()) {
+      expect(q.front().first == m.front().first && q.front().second == m.front().second, "front");
+      expect(q.back().first == m.back().first && q.back().second == m.back().second, "back");
+    }
+
+    std::vector<K> keys;
+    for (size_t i = 0; i < key_range; ++i) {
+      K k = Keys::make(i);
+      size_t n = size_t(std::count_if(m.begin(), m.end(), [&k](std::pair<K, int> const &e) {
+        return has_key(e, k);
+      }));
+      expect(q.count(k) == n, "count");
+      if (n == 0)
+        continue;
+      keys.push_back(k);
+      expect(q.first(k).second == first_of(m, k)->second && q.first(k).first == k, "first");
+      expect(q.last(k).second == last_of(m, k)->second && q.last(k).first == k, "last");
+    }
+
+    std::sort(keys.begin(), keys.end());
+    auto it = q.k_begin();
+    for (auto const &k : keys) {
+      expect(it != q.k_end() && *it == k, "k_iterator order");
+      ++it;
+    }
+    expect(it == q.k_end(), "k_iterator end");
+
+    size_t i = 0;
+    q.for_each([&](K const &k, int v) {
+      expect(i < m.size() && m[i].first == k && m[i].second == v, "queue order");
+      ++i;
+    });
+    expect(i == m.size(), "queue length");
+  }
+
+  void apply(input &in) {
+    uint8_t op = in.byte() % 18;
+    K k = Keys::make(in.byte() % key_range);
+    int v = int(in.byte()) - 128;
+    size_t slot = in.byte() % max_snapshots;
+
+#ifdef KEYED_QUEUE_COUNT_VISITS
+    // Operations on a snapshot, or copying one in, work on its size.
+    size_t size = queue.size();
+    if (slot < snapshots.size())
+      size = std::max(size, snapshots[slot].queue.size());
+    size_t linear = 0;
+    if (op == 5 || op == 16)
+      linear = queue.count(k);
+    else if (op == 13)
+      linear = queue.size();
+    else if (op == 17)
+      linear = 2 * queue.size();
+    keyed_queue_visits::reset();
+#endif
+
+    operate(op, k, v, slot);
+
+#ifdef KEYED_QUEUE_COUNT_VISITS
+    expect(bench::visit_budget(size, linear).ratio() <= 1, "visit budget");
+#endif
+  }
+
+  void operate(uint8_t op, K const &k, int v, size_t slot) {
+    switch (op) {
+    case 0:
+    case 1:
+    case 2:
+      queue.push(k, v);
+      model.emplace_back(k, v);
+      break;
+    case 3:
+      if (model.empty())
+        return expect_failure([&] { queue.pop(); });
+      queue.pop();
+      model.pop_back();
+      break;
+    case 4:
+      if (queue.count(k) == 0)
+        return expect_failure([&] { queue.pop(k); });
+      queue.pop(k);
+      model.erase(last_of(model, k));
+      break;
+    case 5:
+      if (queue.count(k) == 0)
+        return expect_failure([&] { queue.move_to_back(k); });
+      queue.move_to_back(k);
+      std::stable_partition(model.begin(), model.end(), [&k](std::pair<K, int> const &e) {
+        return !has_key(e, k);
+      });
+      break;
+    case 6:
+      if (model.empty())
+        return expect_failure([&] { queue.front(); });
+      queue.front().second = v;
+      model.front().second = v;
+      break;
+    case 7:
+      if (model.empty())
+        return expect_failure([&] { queue.back(); });
+      queue.back().second = v;
+      model.back().second = v;
+      break;
+    case 8:
+      if (queue.count(k) == 0)
+        return expect_failure([&] { queue.first(k); });
+      queue.first(k).second = v;
+      first_of(model, k)->second = v;
+      break;
+    case 9:
+      if (queue.count(k) == 0)
+        return expect_failure([&] { queue.last(k); });
+      queue.last(k).second = v;
+      last_of(model, k)->second = v;
+      break;
+    case 10:
+    case 11:
+      if (snapshots.size() < max_snapshots)
+        snapshots.push_back(copy_t{queue, model});
+      else
+        snapshots[slot] = copy_t{queue, model};
+      break;
+    case 12:
+      if (slot < snapshots.size()) {
+        queue = snapshots[slot].queue;
+        model = snapshots[slot].model;
+      }
+      break;
+    case 13:
+      queue.clear();
+      model.clear();
+      break;
+    case 14: {
+      queue_t &self = queue;
+      queue = self;
+      break;
+    }
+    case 15:
+      // Writes through a snapshot must not reach the queue either.
+      if (slot < snapshots.size()) {
+        snapshots[slot].queue.push(k, v);
+        snapshots[slot].model.emplace_back(k, v);
+      }
+      break;
+    case 16: {
+      if (queue.count(k) == 0)
+        return expect_failure([&] { queue.pop_all(k); });
+      size_t before = model.size();
+      model.erase(std::remove_if(model.begin(), model.end(), [&k](std::pair<K, int> const &e) {
+        return has_key(e, k);
+      }), model.end());
+      expect(queue.pop_all(k) == before - model.size(), "pop_all count");
+      break;
+    }
+    case 17: {
+      auto odd = [v](K const &, int value) {
+        return (value ^ v) % 3 == 0;
+      };
+      size_t before = model.size();
+      model.erase(std::remove_if(model.begin(), model.end(), [&odd](std::pair<K, int> const &e) {
+        return odd(e.first, e.second);
+      }), model.end());
+      expect(queue.erase_if(odd) == before - model.size(), "erase_if count");
+      break;
+    }
+    }
+  }
+
+public:
+  void run(uint8_t const *data, size_t size) {
+    input in(data, size);
+    while (!in.empty()) {
+      apply(in);
+      check(queue, model);
+      for (auto const &s : snapshots)
+        check(s.queue, s.model);
+      ++step;
+    }
+  }
+};
+
+void fuzz_one(uint8_t const *data, size_t size) {
+  if (size == 0)
+    return;
+  if (data[0] & 1)
+    fuzz_run<string_keys>().run(data + 1, size - 1);
+  else
+    fuzz_run<int_keys>().run(data + 1, size - 1);
+}
+
+} // namespace
+
+#ifdef KEYED_QUEUE_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+  fuzz_one(data, size);
+  return 0;
+}
+
+#else
+
+int main(int argc, char **argv) {
+  size_t runs = 2000;
+  size_t length = 4096;
+  uint64_t seed = 1;
+  bool usage = false;
+
+  for (int i = 1; i < argc && !usage; ++i) {
+    if (!std::strcmp(argv[i], "--runs") && i + 1 < argc)
+      runs = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--length") && i + 1 < argc)
+      length = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--seed") && i + 1 < argc)
+      seed = std::strtoull(argv[++i], nullptr, 10);
+    else
+      usage = true;
+  }
+  if (usage) {
+    std::fprintf(stderr, "usage: %s [--runs n] [--length n] [--seed n]\n", argv[0]);
+    return 2;
+  }
+
+  std::mt19937_64 rng(seed);
+  std::vector<uint8_t> data;
+  for (size_t run = 0; run < runs; ++run) {
+    data.resize(1 + rng() % (length + 1));
+    for (auto &b : data)
+      b = uint8_t(rng());
+    fuzz_one(data.data(), data.size());
+  }
+  std::printf("%zu runs of up to %zu bytes, no mismatches\n", runs, length);
+  return 0;
+}
+
+#endif
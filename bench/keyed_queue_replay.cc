@@ -0,0 +1,379 @@
+// Replays a trace written by recording_keyed_queue against a chosen
+// keyed_queue configuration and reports throughput, per-operation latency
+// percentiles and peak resident memory.
+//
+//   keyed_queue_replay [--variant std|arena|arena-huge|ring|adaptive] [--counters] trace-file
+//   keyed_queue_replay --synthesize trace-file [--ops n] [--keys n]
+//
+// Keys are replayed as their recorded 64-bit hashes and values as strings
+// of the recorded size. Operations that failed in the recorded program fail
+// the same way here and are counted, not timed.
+//
+// With --counters every operation is also bracketed by hardware counter
+// reads, reported per operation kind with the cost of the reads removed.
+//
+// Built with -DKEYED_QUEUE_COUNT_VISITS, every operation's element visits
+// and key comparisons are checked against its asymptotic budget
+// (bench::visit_budget): O(1) elements and O(log n) comparisons,
+// O(count(k)) elements for move_to_back and O(n) for clear, and the
+// wholesale copies the operation made. The ring and adaptive variants get
+// twice the constants for the slots a ring compacts per mutation.
+// Operations over budget are reported and make the tool exit with status 1.
+
+#include "keyed_queue.h"
+#include "keyed_queue_storage.h"
+#include "recording_keyed_queue.h"
+#include "ring_keyed_queue.h"
+#include "adaptive_keyed_queue.h"
+#include "bench_util.h"
+#include "perf_counters.h"
+#include "visit_budget.h"
+
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <sys/resource.h>
+
+namespace {
+
+char const *const op_names[] = {
+  "", "push", "pop", "pop(k)", "move_to_back", "front", "back", "first", "last",
+  "count", "copy", "clear", "destroy", "front const", "back const", "first const", "last const"
+};
+const size_t op_kinds = sizeof(op_names) / sizeof(op_names[0]);
+
+struct results {
+  bench::histogram latency[op_kinds];
+  bench::counter_totals counts[op_kinds];
+  size_t failed = 0;
+  size_t malformed = 0;
+};
+
+#ifdef KEYED_QUEUE_COUNT_VISITS
+struct budget_check {
+  double scale;
+  size_t over[op_kinds] = {};
+  double worst[op_kinds] = {};
+  size_t worst_at[op_kinds] = {};
+  size_t size = 0;
+  size_t key_count = 0;
+
+  explicit budget_check(double s) : scale(s) {
+  }
+
+  template <class Queue>
+  void before(std::unordered_map<uint64_t, Queue> const &queues, trace::record const &r) {
+    auto it = queues.find(r.queue);
+    size = it == queues.end() ? 0 : it->second.size();
+    key_count = it == queues.end() || !trace::has_key(r.code) ? 0 : it->second.count(r.key);
+    keyed_queue_visits::reset();
+  }
+
+  void after(trace::record const &r, size_t kind, size_t index) {
+    size_t linear = 0;
+    switch (r.code) {
+    case trace::op::move_to_back:
+      linear = key_count;
+      break;
+    case trace::op::clear:
+      linear = size;
+      break;
+    default:
+      break;
+    }
+
+    // Copies, mutations and mutable access clone a queue that is shared,
+    // or, for copies, one that was handed out mutably.
+    double ratio = bench::visit_budget(size, linear, scale).ratio();
+    if (ratio > 1) {
+      ++over[kind];
+      if (ratio > worst[kind]) {
+        worst[kind] = ratio;
+        worst_at[kind] = index;
+      }
+    }
+  }
+
+  bool report() const {
+    bool ok = true;
+    for (size_t i = 1; i < op_kinds; ++i) {
+      if (over[i] == 0)
+        continue;
+      ok = false;
+      std::printf("%-14s %zu operations over budget, worst %.1fx at operation %zu\n",
+                  op_names[i], over[i], worst[i], worst_at[i]);
+    }
+    if (ok)
+      std::printf("all operations within their visit budgets\n");
+    return ok;
+  }
+};
+#endif
+
+class value_pool {
+private:
+  std::unordered_map<uint64_t, std::string> values;
+
+public:
+  std::string const &operator()(uint64_t size) {
+    auto it = values.find(size);
+    if (it == values.end())
+      it = values.emplace(size, std::string(size, 'v')).first;
+    return it->second;
+  }
+};
+
+template <class Queue>
+bool apply(std::unordered_map<uint64_t, Queue> &queues, trace::record const &r,
+           value_pool &values, Queue const &prototype) {
+  if (r.code == trace::op::destroy) {
+    queues.erase(r.queue);
+    return true;
+  }
+
+  auto it = queues.find(r.queue);
+  if (it == queues.end())
+    it = queues.emplace(r.queue, prototype).first;
+  Queue &q = it->second;
+  Queue const &cq = q;
+
+  try {
+    switch (r.code) {
+    case trace::op::push:
+      q.push(r.key, values(r.value_size));
+      break;
+    case trace::op::pop:
+      if (q.empty())
+        return false;
+      q.pop();
+      break;
+    case trace::op::pop_key:
+      q.pop(r.key);
+      break;
+    case trace::op::move_to_back:
+      q.move_to_back(r.key);
+      break;
+    case trace::op::front:
+      bench::do_not_optimize(q.front().second.size());
+      break;
+    case trace::op::back:
+      bench::do_not_optimize(q.back().second.size());
+      break;
+    case trace::op::first:
+      bench::do_not_optimize(q.first(r.key).second.size());
+      break;
+    case trace::op::last:
+      bench::do_not_optimize(q.last(r.key).second.size());
+      break;
+    case trace::op::const_front:
+      bench::do_not_optimize(cq.front().second.size());
+      break;
+    case trace::op::const_back:
+      bench::do_not_optimize(cq.back().second.size());
+      break;
+    case trace::op::const_first:
+      bench::do_not_optimize(cq.first(r.key).second.size());
+      break;
+    case trace::op::const_last:
+      bench::do_not_optimize(cq.last(r.key).second.size());
+      break;
+    case trace::op::count:
+      bench::do_not_optimize(q.count(r.key));
+      break;
+    case trace::op::copy:
+      queues.erase(r.target);
+      queues.emplace(r.target, q);
+      break;
+    case trace::op::clear:
+      q.clear();
+      break;
+    default:
+      return false;
+    }
+  }
+  catch (lookup_error &) {
+    return false;
+  }
+  return true;
+}
+
+template <class Queue>
+bool replay(std::istream &in, Queue const &prototype, char const *variant, bool counters, double scale = 1) {
+  trace::reader reader(in);
+  if (!reader.good()) {
+    std::fprintf(stderr, "not a keyed_queue trace\n");
+    std::exit(1);
+  }
+
+  results res;
+  value_pool values;
+  std::unordered_map<uint64_t, Queue> queues;
+  trace::record r;
+  size_t ops = 0;
+
+#ifdef KEYED_QUEUE_COUNT_VISITS
+  budget_check budgets(scale);
+#endif
+
+  bench::perf_counters pc;
+  if (counters)
+    for (auto &c : res.counts)
+      c.calibrate(pc);
+
+  auto start = bench::clock::now();
+  while (reader.next(r)) {
+    size_t kind = size_t(r.code);
+    if (kind == 0 || kind >= op_kinds) {
+      ++res.malformed;
+      continue;
+    }
+#ifdef KEYED_QUEUE_COUNT_VISITS
+    budgets.before(queues, r);
+#endif
+    bench::perf_counters::sample counted;
+    if (counters)
+      counted = pc.read();
+    auto before = bench::clock::now();
+    bool ok = apply(queues, r, values, prototype);
+    auto ns = uint64_t(bench::elapsed_ns(before));
+#ifdef KEYED_QUEUE_COUNT_VISITS
+    budgets.after(r, kind, ops);
+#endif
+    if (counters && ok)
+      res.counts[kind].add(counted, pc.read());
+    if (ok)
+      res.latency[kind].record(ns);
+    else
+      ++res.failed;
+    ++ops;
+  }
+  double total_ns = bench::elapsed_ns(start);
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  std::printf("variant %s: %zu operations in %.1f ms, %.0f ops/s, peak RSS %ld KiB\n",
+              variant, ops, total_ns / 1e6, ops / (total_ns / 1e9), usage.ru_maxrss);
+  std::printf("%-14s %10s %8s %8s %8s %8s %10s\n", "operation", "count", "p50", "p90", "p99", "p99.9", "max ns");
+  for (size_t i = 1; i < op_kinds; ++i) {
+    bench::histogram const &h = res.latency[i];
+    if (h.samples() == 0)
+      continue;
+    std::printf("%-14s %10llu %8llu %8llu %8llu %8llu %10llu\n", op_names[i],
+                (unsigned long long) h.samples(), (unsigned long long) h.percentile(0.5),
+                (unsigned long long) h.percentile(0.9), (unsigned long long) h.percentile(0.99),
+                (unsigned long long) h.percentile(0.999), (unsigned long long) h.max());
+    if (counters)
+      res.counts[i].print(pc, h.samples());
+  }
+  if (res.failed != 0 || res.malformed != 0)
+    std::printf("failed %zu, malformed %zu\n", res.failed, res.malformed);
+
+#ifdef KEYED_QUEUE_COUNT_VISITS
+  return budgets.report();
+#else
+  (void) scale;
+  return true;
+#endif
+}
+
+// A mixed workload through recording_keyed_queue, for trying the tool out.
+void synthesize(char const *path, size_t ops, size_t keys) {
+  std::ofstream out(path, std::ios::binary);
+  auto log = std::make_shared<trace::writer>(out);
+  recording_keyed_queue<uint64_t, std::string> q(log);
+  bench::zipf_distribution zipf(keys, 0.9);
+  std::mt19937_64 rng(1);
+
+  for (size_t i = 0; i < ops; ++i) {
+    uint64_t k = zipf(rng);
+    unsigned dice = rng() % 100;
+    try {
+      if (dice < 40)
+        q.push(k, std::string(16 + rng() % 112, 'x'));
+      else if (dice < 60 && !q.empty())
+        q.pop();
+      else if (dice < 70)
+        q.pop(k);
+      else if (dice < 75)
+        q.move_to_back(k);
+      else if (dice < 90)
+        q.count(k);
+      else if (dice < 99 || rng() % 64 != 0)
+        q.first(k);
+      else {
+        auto snapshot = q;
+        static_cast<decltype(q) const &>(snapshot).front();
+      }
+    }
+    catch (lookup_error &) {
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string variant = "std";
+  char const *path = nullptr;
+  char const *synthesize_to = nullptr;
+  size_t ops = 1000000;
+  size_t keys = 10000;
+  bool usage = false;
+  bool counters = false;
+
+  for (int i = 1; i < argc && !usage; ++i) {
+    if (!std::strcmp(argv[i], "--variant") && i + 1 < argc)
+      variant = argv[++i];
+    else if (!std::strcmp(argv[i], "--counters"))
+      counters = true;
+    else if (!std::strcmp(argv[i], "--synthesize") && i + 1 < argc)
+      synthesize_to = argv[++i];
+    else if (!std::strcmp(argv[i], "--ops") && i + 1 < argc)
+      ops = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--keys") && i + 1 < argc)
+      keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (argv[i][0] != '-' && path == nullptr)
+      path = argv[i];
+    else
+      usage = true;
+  }
+
+  if (synthesize_to != nullptr && !usage) {
+    synthesize(synthesize_to, ops, keys);
+    return 0;
+  }
+  if (path == nullptr || usage) {
+    std::fprintf(stderr, "usage: %s [--variant std|arena|arena-huge|ring|adaptive] [--counters] trace-file\n"
+                         "       %s --synthesize trace-file [--ops n] [--keys n]\n", argv[0], argv[0]);
+    return 2;
+  }
+
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::perror(path);
+    return 1;
+  }
+
+  using arena_alloc = arena_allocator<std::pair<const uint64_t, std::string>>;
+  bool ok;
+  if (variant == "std")
+    ok = replay(in, keyed_queue<uint64_t, std::string>(), "std", counters);
+  else if (variant == "arena")
+    ok = replay(in, keyed_queue<uint64_t, std::string, arena_alloc>(arena_alloc()), "arena", counters);
+  else if (variant == "arena-huge")
+    ok = replay(in, keyed_queue<uint64_t, std::string, arena_alloc>(arena_alloc(storage_options::huge())), "arena-huge", counters);
+  else if (variant == "ring")
+    ok = replay(in, ring_keyed_queue<uint64_t, std::string>(), "ring", counters, 2);
+  else if (variant == "adaptive")
+    ok = replay(in, adaptive_keyed_queue<uint64_t, std::string>(), "adaptive", counters, 2);
+  else {
+    std::fprintf(stderr, "unknown variant %s\n", variant.c_str());
+    return 2;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+#ifndef BENCH_PERF_COUNTERS_H
+#define BENCH_PERF_COUNTERS_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace bench {
+
+// Hardware counters of the calling thread, user space only, opened as one
+// perf_event group so that a single read() returns all of them. Events the
+// CPU, kernel or perf_event_paranoid setting refuse are left out; without
+// any of them every read returns zeros and the report says so.
+//
+// The kernel multiplexes groups that do not fit the hardware counters, so
+// each read also carries how long the group was enabled and how long it
+// actually counted; counter_totals scales by their ratio and reports a
+// region the group never ran in as unmeasured rather than as zero.
+class perf_counters {
+public:
+  enum event {
+    cycles,
+    instructions,
+    l1d_misses,
+    llc_misses,
+    dtlb_misses,
+    branch_misses,
+    event_count
+  };
+
+  struct sample {
+    uint64_t value[event_count];
+    uint64_t enabled;
+    uint64_t running;
+  };
+
+  static char const *name(size_t e) {
+    static char const *const names[event_count] = {
+      "cycles", "instructions", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss"
+    };
+    return names[e];
+  }
+
+private:
+  int leader;
+  int fds[event_count];
+  int slot[event_count];
+  size_t opened;
+
+#ifdef __linux__
+  static int open_event(uint32_t type, uint64_t config, int group) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return int(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+  }
+
+  static uint64_t cache_event(uint64_t cache, uint64_t result) {
+    return cache | (uint64_t(PERF_COUNT_HW_CACHE_OP_READ) << 8) | (result << 16);
+  }
+#endif
+
+public:
+  perf_counters() : leader(-1), opened(0) {
+    for (size_t e = 0; e < event_count; ++e) {
+      fds[e] = -1;
+      slot[e] = -1;
+    }
+
+#ifdef __linux__
+    struct {
+      uint32_t type;
+      uint64_t config;
+    } const events[event_count] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+
+    for (size_t e = 0; e < event_count; ++e) {
+      int fd = open_event(events[e].type, events[e].config, leader);
+      if (fd < 0)
+        continue;
+      if (leader == -1)
+        leader = fd;
+      fds[e] = fd;
+      slot[e] = int(opened++);
+    }
+
+    if (leader != -1) {
+      ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  perf_counters(perf_counters const &) = delete;
+  perf_counters &operator=(perf_counters const &) = delete;
+
+  ~perf_counters() {
+#ifdef __linux__
+    for (size_t e = 0; e < event_count; ++e)
+      if (fds[e] != -1)
+        close(fds[e]);
+#endif
+  }
+
+  bool available(size_t e) const noexcept {
+    return slot[e] != -1;
+  }
+
+  bool any() const noexcept {
+    return opened != 0;
+  }
+
+  sample read() const {
+    sample s;
+    std::memset(&s, 0, sizeof(s));
+#ifdef __linux__
+    if (leader == -1)
+      return s;
+    // nr, time_enabled, time_running, then one value per opened event.
+    uint64_t buffer[3 + event_count];
+    if (::read(leader, buffer, sizeof(buffer)) < ssize_t(3 * sizeof(uint64_t)))
+      return s;
+    s.enabled = buffer[1];
+    s.running = buffer[2];
+    for (size_t e = 0; e < event_count; ++e)
+      if (slot[e] != -1 && uint64_t(slot[e]) < buffer[0])
+        s.value[e] = buffer[3 + slot[e]];
+#endif
+    return s;
+  }
+};
+
+// Counter deltas summed over measured regions, scaled up to the time the
+// group was enabled when it was multiplexed, with the cost of the
+// measurement itself subtracted when a baseline is set.
+class counter_totals {
+private:
+  double value[perf_counters::event_count];
+  double overhead[perf_counters::event_count];
+  size_t regions;
+  size_t unmeasured;
+  double enabled;
+  double running;
+
+public:
+  counter_totals() : regions(0), unmeasured(0), enabled(0), running(0) {
+    for (size_t e = 0; e < perf_counters::event_count; ++e)
+      value[e] = overhead[e] = 0;
+  }
+
+  void add(perf_counters::sample const &before, perf_counters::sample const &after) {
+    ++regions;
+    uint64_t ran = after.running - before.running;
+    if (ran == 0) {
+      ++unmeasured;
+      return;
+    }
+    double scale = double(after.enabled - before.enabled) / double(ran);
+    for (size_t e = 0; e < perf_counters::event_count; ++e)
+      value[e] += double(after.value[e] - before.value[e]) * scale;
+    enabled += double(after.enabled - before.enabled);
+    running += double(ran);
+  }
+
+  // Whether any region was counted, if only for part of the time. Per-op
+  // figures extrapolate from the counted regions to all of them.
+  bool measured() const noexcept {
+    return regions > unmeasured;
+  }
+
+  // Measures empty regions so that per-region read cost can be subtracted.
+  void calibrate(perf_counters const &pc, size_t rounds = 1000) {
+    counter_totals empty;
+    for (size_t i = 0; i < rounds; ++i) {
+      auto before = pc.read();
+      auto after = pc.read();
+      empty.add(before, after);
+    }
+    for (size_t e = 0; e < perf_counters::event_count; ++e)
+      overhead[e] = empty.value[e] / double(rounds);
+  }
+
+  double per_op(size_t e, size_t ops) const {
+    if (ops == 0 || !measured())
+      return 0;
+    double counted = double(regions - unmeasured);
+    double net = value[e] - overhead[e] * counted;
+    return (net > 0 ? net : 0) / (double(ops) * counted / double(regions));
+  }
+
+  // One line of per-operation counts, or a note when nothing was counted.
+  void print(perf_counters const &pc, size_t ops, FILE *out = stdout) const {
+    if (!pc.any()) {
+      std::fprintf(out, "  (hardware counters unavailable)\n");
+      return;
+    }
+    if (!measured()) {
+      std::fprintf(out, "  (hardware counters never scheduled)\n");
+      return;
+    }
+    std::fprintf(out, " ");
+    for (size_t e = 0; e < perf_counters::event_count; ++e) {
+      if (pc.available(e))
+        std::fprintf(out, " %s %.2f", perf_counters::name(e), per_op(e, ops));
+      else
+        std::fprintf(out, " %s n/a", perf_counters::name(e));
+    }
+    if (pc.available(perf_counters::cycles) && pc.available(perf_counters::instructions) &&
+        per_op(perf_counters::cycles, ops) > 0)
+      std::fprintf(out, "  IPC %.2f", per_op(perf_counters::instructions, ops) /
+                                           per_op(perf_counters::cycles, ops));
+    if (running < enabled)
+      std::fprintf(out, "  (scaled, counted %.0f%% of the time)", 100 * running / enabled);
+    if (unmeasured != 0)
+      std::fprintf(out, "  (%zu of %zu regions not counted)", unmeasured, regions);
+    std::fprintf(out, "\n");
+  }
+};
+
+} // namespace bench
+
+#endif /* BENCH_PERF_COUNTERS_H */
@@ -0,0 +1,103 @@
+// Scan and move_to_back cost of keyed_queue under different storage
+// placements. Run it pinned to one node with the queue bound to the other
+// (e.g. `numactl -N 0 ./placement_bench --bind 1`) to see the remote-access
+// cost, and compare the dTLB-miss counts of the huge-page rows against the
+// default ones for TLB reach.
+
+#include "keyed_queue.h"
+#include "keyed_queue_storage.h"
+#include "bench_util.h"
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+struct config {
+  size_t entries = 1 << 20;
+  size_t keys = 1 << 16;
+  size_t moves = 1 << 14;
+  int bind_node = -1;
+};
+
+template <class Queue>
+void run(char const *name, Queue q, config const &c, bench::perf_counters const &pc) {
+  std::mt19937_64 rng(42);
+  bench::counter_totals push_counts, scan_counts, move_counts;
+
+  auto before = pc.read();
+  auto start = bench::clock::now();
+  for (size_t i = 0; i < c.entries; ++i)
+    q.push(i * 2654435761u % c.keys, i);
+  double push_ns = bench::elapsed_ns(start) / std::max<size_t>(c.entries, 1);
+  push_counts.add(before, pc.read());
+
+  // With fewer entries than keys only some keys are present, so the moves
+  // draw from the keys the scan found.
+  std::vector<size_t> present;
+  present.reserve(std::min(c.keys, c.entries));
+  size_t sum = 0;
+  before = pc.read();
+  start = bench::clock::now();
+  for (auto it = q.k_begin(); it != q.k_end(); ++it) {
+    sum += q.count(*it);
+    present.push_back(*it);
+  }
+  double scan_ns = bench::elapsed_ns(start) / std::max<size_t>(present.size(), 1);
+  scan_counts.add(before, pc.read());
+
+  size_t moves = present.empty() ? 0 : c.moves;
+  before = pc.read();
+  start = bench::clock::now();
+  for (size_t i = 0; i < moves; ++i)
+    q.move_to_back(present[rng() % present.size()]);
+  double move_ns = bench::elapsed_ns(start) / std::max<size_t>(moves, 1);
+  move_counts.add(before, pc.read());
+
+  std::printf("%-24s push %8.1f ns  k_iterator+count %8.1f ns/key  move_to_back %10.1f ns  (%zu)\n",
+              name, push_ns, scan_ns, move_ns, sum);
+  std::printf("  push per op:");
+  push_counts.print(pc, c.entries);
+  std::printf("  scan per key:");
+  scan_counts.print(pc, present.size());
+  std::printf("  move_to_back per op:");
+  move_counts.print(pc, moves);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  config c;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--entries") && i + 1 < argc)
+      c.entries = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--keys") && i + 1 < argc)
+      c.keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--moves") && i + 1 < argc)
+      c.moves = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--bind") && i + 1 < argc)
+      c.bind_node = std::atoi(argv[++i]);
+    else {
+      std::fprintf(stderr, "usage: %s [--entries n] [--keys n] [--moves n] [--bind node]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  using alloc_t = arena_allocator<std::pair<const size_t, size_t>>;
+  using arena_queue = keyed_queue<size_t, size_t, alloc_t>;
+
+  bench::perf_counters pc;
+  run("std::allocator", keyed_queue<size_t, size_t>(), c, pc);
+  run("arena", arena_queue(alloc_t(storage_options())), c, pc);
+  run("arena huge", arena_queue(alloc_t(storage_options::huge())), c, pc);
+  run("arena huge interleave", arena_queue(alloc_t(storage_options::interleaved(online_numa_nodes(), true))), c, pc);
+  if (c.bind_node >= 0)
+    run("arena huge bind", arena_queue(alloc_t(storage_options::bound_to(c.bind_node, true))), c, pc);
+
+  return 0;
+}
@@ -0,0 +1,156 @@
+// Throughput, fairness and latency of a thread-safe keyed queue under mixed
+// workloads. Every combination of thread count (1 to --max-threads, doubling),
+// key distribution (uniform and Zipfian) and read percentage runs for a fixed
+// time against each implementation registered in make_queues().
+//
+// Reads are count(k); writes are push (50%), pop (25%), pop(k) (15%) and
+// move_to_back (10%), which keeps the queue size roughly stable. Fairness is
+// Jain's index over per-thread operation counts: 1 when all threads got
+// equal service, 1/n when one thread got all of it.
+
+#include "bench_util.h"
+#include "concurrent_queue_adapter.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+namespace {
+
+struct config {
+  size_t max_threads = 64;
+  size_t keys = 1 << 16;
+  size_t prefill = 1 << 18;
+  double zipf_skew = 0.99;
+  unsigned millis = 200;
+  std::vector<unsigned> read_percents = {0, 50, 90, 99};
+};
+
+std::vector<std::function<std::unique_ptr<bench::concurrent_queue>()>> make_queues() {
+  return {
+    [] { return std::unique_ptr<bench::concurrent_queue>(new bench::mutex_keyed_queue()); },
+  };
+}
+
+struct thread_result {
+  size_t ops = 0;
+  bench::histogram latency;
+};
+
+void run(bench::concurrent_queue &q, config const &c, size_t threads, bool zipf, unsigned reads) {
+  bench::zipf_distribution keys(c.keys, zipf ? c.zipf_skew : 0.0);
+  {
+    std::mt19937_64 rng(11);
+    for (size_t i = 0; i < c.prefill; ++i)
+      q.push(keys(rng), i);
+  }
+
+  std::atomic<bool> go(false), stop(false);
+  std::vector<thread_result> results(threads);
+  std::vector<std::thread> workers;
+
+  for (size_t t = 0; t < threads; ++t)
+    workers.emplace_back([&, t] {
+      std::mt19937_64 rng(1000 + t);
+      bench::zipf_distribution local(keys);
+      // Counted locally and stored once, so that neighbouring results do
+      // not share cache lines while the threads are measured.
+      thread_result r;
+      while (!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+
+      while (!stop.load(std::memory_order_relaxed)) {
+        uint64_t k = local(rng);
+        unsigned dice = rng() % 100;
+        auto start = bench::clock::now();
+        if (dice < reads) {
+          bench::do_not_optimize(q.count(k));
+        }
+        else {
+          unsigned w = rng() % 100;
+          if (w < 50)
+            q.push(k, r.ops);
+          else if (w < 75)
+            q.pop();
+          else if (w < 90)
+            q.pop(k);
+          else
+            q.move_to_back(k);
+        }
+        r.latency.record(uint64_t(bench::elapsed_ns(start)));
+        ++r.ops;
+      }
+      results[t] = std::move(r);
+    });
+
+  auto start = bench::clock::now();
+  go.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::milliseconds(c.millis));
+  stop.store(true);
+  for (auto &w : workers)
+    w.join();
+  double seconds = bench::elapsed_ns(start) / 1e9;
+
+  bench::histogram latency;
+  double sum = 0, squares = 0;
+  for (auto const &r : results) {
+    latency.merge(r.latency);
+    sum += double(r.ops);
+    squares += double(r.ops) * double(r.ops);
+  }
+  double fairness = squares > 0 ? sum * sum / (double(threads) * squares) : 0;
+
+  std::printf("%-18s %7zu %-8s %5u%% %12.0f %8.3f %8llu %8llu %8llu %10llu\n", q.name().c_str(),
+              threads, zipf ? "zipf" : "uniform", reads, sum / seconds, fairness,
+              (unsigned long long) latency.percentile(0.5), (unsigned long long) latency.percentile(0.99),
+              (unsigned long long) latency.percentile(0.999), (unsigned long long) latency.max());
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  config c;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--max-threads") && i + 1 < argc)
+      c.max_threads = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--keys") && i + 1 < argc)
+      c.keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--prefill") && i + 1 < argc)
+      c.prefill = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--skew") && i + 1 < argc)
+      c.zipf_skew = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--millis") && i + 1 < argc)
+      c.millis = unsigned(std::atoi(argv[++i]));
+    else if (!std::strcmp(argv[i], "--reads") && i + 1 < argc) {
+      c.read_percents.clear();
+      for (char *p = argv[++i]; *p != '\0';) {
+        c.read_percents.push_back(unsigned(std::strtoul(p, &p, 10)));
+        if (*p == ',')
+          ++p;
+        else if (*p != '\0')
+          break;
+      }
+    }
+    else {
+      std::fprintf(stderr, "usage: %s [--max-threads n] [--keys n] [--prefill n] [--skew s]\n"
+                           "          [--millis n] [--reads p1,p2,...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  std::printf("%-18s %7s %-8s %6s %12s %8s %8s %8s %8s %10s\n", "queue", "threads", "keys", "reads",
+              "ops/s", "fairness", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+  for (auto const &make : make_queues())
+    for (size_t threads = 1; threads <= c.max_threads; threads *= 2)
+      for (bool zipf : {false, true})
+        for (unsigned reads : c.read_percents) {
+          auto q = make();
+          run(*q, c, threads, zipf, reads);
+        }
+  return 0;
+}
@@ -0,0 +1,134 @@
+// Writer latency while reader threads keep taking snapshots. Readers copy
+// the shared keyed_queue under a mutex and walk the copy's keys outside it;
+// the writer does push, pop and move_to_back under the same mutex. Every
+// writer operation and every reader copy goes into a latency histogram, so
+// the tail cost of copy-on-write detaches shows up end to end.
+
+#include "keyed_queue.h"
+#include "bench_util.h"
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+struct config {
+  size_t min_size = 1000;
+  size_t max_size = 1000000;
+  size_t readers = 2;
+  size_t ops = 100000;
+  size_t entries_per_key = 16;
+};
+
+void print(char const *name, bench::histogram const &h) {
+  std::printf("  %-14s %9llu %9llu %9llu %9llu %9llu %11llu\n", name,
+              (unsigned long long) h.samples(), (unsigned long long) h.percentile(0.5),
+              (unsigned long long) h.percentile(0.99), (unsigned long long) h.percentile(0.999),
+              (unsigned long long) h.percentile(0.9999), (unsigned long long) h.max());
+}
+
+void run(config const &c, size_t size) {
+  using queue_t = keyed_queue<size_t, size_t>;
+  size_t keys = std::max<size_t>(1, size / c.entries_per_key);
+
+  queue_t shared;
+  for (size_t i = 0; i < size; ++i)
+    shared.push(i % keys, i);
+
+  std::mutex mutex;
+  std::atomic<bool> stop(false);
+  std::vector<bench::histogram> copy_latency(c.readers), scan_latency(c.readers);
+  std::vector<std::thread> readers;
+
+  for (size_t r = 0; r < c.readers; ++r)
+    readers.emplace_back([&, r] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        auto start = bench::clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        queue_t snapshot = shared;
+        lock.unlock();
+        copy_latency[r].record(uint64_t(bench::elapsed_ns(start)));
+
+        start = bench::clock::now();
+        size_t seen = 0;
+        for (auto it = snapshot.k_begin(); it != snapshot.k_end(); ++it)
+          ++seen;
+        bench::do_not_optimize(seen);
+        scan_latency[r].record(uint64_t(bench::elapsed_ns(start)));
+      }
+    });
+
+  bench::histogram push_latency, pop_latency, move_latency;
+  std::mt19937_64 rng(3);
+  for (size_t i = 0; i < c.ops; ++i) {
+    size_t k = rng() % keys;
+    bench::histogram *h;
+    auto start = bench::clock::now();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      switch (i % 3) {
+      case 0:
+        shared.push(k, i);
+        h = &push_latency;
+        break;
+      case 1:
+        shared.pop();
+        h = &pop_latency;
+        break;
+      default:
+        shared.move_to_back(k);
+        h = &move_latency;
+        break;
+      }
+    }
+    h->record(uint64_t(bench::elapsed_ns(start)));
+  }
+
+  stop.store(true);
+  for (auto &t : readers)
+    t.join();
+
+  bench::histogram copies, scans;
+  for (size_t r = 0; r < c.readers; ++r) {
+    copies.merge(copy_latency[r]);
+    scans.merge(scan_latency[r]);
+  }
+
+  std::printf("%zu entries, %zu keys, %zu readers\n", size, keys, c.readers);
+  std::printf("  %-14s %9s %9s %9s %9s %9s %11s\n", "ns", "count", "p50", "p99", "p99.9", "p99.99", "max");
+  print("push", push_latency);
+  print("pop", pop_latency);
+  print("move_to_back", move_latency);
+  print("reader copy", copies);
+  print("reader scan", scans);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  config c;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--min-size") && i + 1 < argc)
+      c.min_size = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--max-size") && i + 1 < argc)
+      c.max_size = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--readers") && i + 1 < argc)
+      c.readers = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--ops") && i + 1 < argc)
+      c.ops = std::strtoull(argv[++i], nullptr, 10);
+    else {
+      std::fprintf(stderr, "usage: %s [--min-size n] [--max-size n] [--readers n] [--ops n]\n"
+                           "sizes go up by factors of ten, e.g. --max-size 100000000\n", argv[0]);
+      return 2;
+    }
+  }
+
+  for (size_t size = std::max<size_t>(c.min_size, 1); size <= c.max_size; size *= 10)
+    run(c, size);
+  return 0;
+}
@@ -0,0 +1,93 @@
+// Consumption of a skewed key distribution by a work_stealing_pool, with
+// stealing off and on. Each element costs a fixed amount of busy work; keys
+// are homed by hash, so under skew a few workers receive most elements.
+
+#include "work_stealing_pool.h"
+#include "bench_util.h"
+
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+struct config {
+  size_t workers = 4;
+  size_t elements = 1 << 18;
+  size_t keys = 1 << 12;
+  double skew = 1.2;
+  unsigned work = 200;
+};
+
+void burn(unsigned iterations) {
+  unsigned long x = iterations;
+  for (unsigned i = 0; i < iterations; ++i)
+    x = x * 6364136223846793005ul + 1442695040888963407ul;
+  bench::do_not_optimize(x);
+}
+
+void run(config const &c, bool stealing) {
+  work_stealing_pool<size_t, size_t> pool(c.workers);
+  bench::zipf_distribution zipf(c.keys, c.skew);
+  std::mt19937_64 rng(7);
+  for (size_t i = 0; i < c.elements; ++i)
+    pool.push(zipf(rng), i);
+
+  std::vector<size_t> done(c.workers);
+  std::atomic<size_t> remaining(c.elements);
+  std::vector<std::thread> threads;
+
+  auto start = bench::clock::now();
+  for (size_t w = 0; w < c.workers; ++w)
+    threads.emplace_back([&, w] {
+      size_t k, v;
+      while (remaining.load(std::memory_order_relaxed) != 0) {
+        bool got = stealing ? pool.try_pop_or_steal(w, k, v) : pool.try_pop(w, k, v);
+        if (!got) {
+          if (!stealing && pool.size(w) == 0)
+            break;
+          std::this_thread::yield();
+          continue;
+        }
+        burn(c.work);
+        ++done[w];
+        remaining.fetch_sub(1, std::memory_order_relaxed);
+      }
+    });
+  for (auto &t : threads)
+    t.join();
+  double ms = bench::elapsed_ns(start) / 1e6;
+
+  size_t most = *std::max_element(done.begin(), done.end());
+  std::printf("%-12s %9.1f ms  %10.0f elements/s  busiest worker %5.1f%%\n",
+              stealing ? "stealing" : "no stealing", ms, c.elements / (ms / 1e3),
+              100.0 * most / c.elements);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  config c;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--workers") && i + 1 < argc)
+      c.workers = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--elements") && i + 1 < argc)
+      c.elements = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--keys") && i + 1 < argc)
+      c.keys = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--skew") && i + 1 < argc)
+      c.skew = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--work") && i + 1 < argc)
+      c.work = std::atoi(argv[++i]);
+    else {
+      std::fprintf(stderr, "usage: %s [--workers n] [--elements n] [--keys n] [--skew s] [--work n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  run(c, false);
+  run(c, true);
+  return 0;
+}
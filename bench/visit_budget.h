@@ -0,0 +1,51 @@
+#ifndef BENCH_VISIT_BUDGET_H
+#define BENCH_VISIT_BUDGET_H
+
+#include "keyed_queue.h"
+
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+
+namespace bench {
+
+#ifdef KEYED_QUEUE_COUNT_VISITS
+// Asymptotic budget of one queue operation, against the element visits and
+// key comparisons counted since keyed_queue_visits::reset(): O(1) elements
+// and O(log n) comparisons, plus linear elements for an operation that
+// touches every entry of a key (move_to_back, pop_all) or of the queue
+// (clear, erase_if). Only an operation that made wholesale copies (copy-on-
+// write detaches, adaptive migrations, ring growth) may also pay for them,
+// each up to the whole queue: O(n) elements and O(n log n) comparisons.
+//
+// scale multiplies the constants, for representations whose O(1) steps do
+// more work, such as a ring that compacts a few slots per mutation.
+class visit_budget {
+private:
+  double elements;
+  double comparisons;
+
+public:
+  visit_budget(size_t size, size_t linear, double scale = 1) {
+    double log_n = std::log2(double(size) + 2);
+    elements = scale * (4 + double(linear));
+    comparisons = scale * 4 * (log_n + 2);
+
+    if (keyed_queue_visits::clones != 0) {
+      double cloned = double(std::min(keyed_queue_visits::cloned, keyed_queue_visits::clones * size));
+      elements += scale * 3 * cloned;
+      comparisons += scale * 4 * (cloned + 1) * (std::log2(cloned + 2) + 2);
+    }
+  }
+
+  // Visits over budget, as a multiple of it; above 1 is over budget.
+  double ratio() const {
+    return std::max(double(keyed_queue_visits::elements) / elements,
+                    double(keyed_queue_visits::comparisons) / comparisons);
+  }
+};
+#endif
+
+} // namespace bench
+
+#endif /* BENCH_VISIT_BUDGET_H */
@@ -0,0 +1,714 @@
+#ifndef COMPACT_KEYED_QUEUE_H
+#define COMPACT_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <map>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+// Ordered set of string keys, each with a numeric id, stored front-coded:
+// sorted blocks of up to block_keys keys, each block holding its first key
+// whole and every following key as the length it shares with its
+// predecessor and the rest. New keys go to a small ordered delta map, which
+// is merged into the blocks once it outgrows an eighth of the keys; erased
+// keys leave their block slot empty until the next merge, or until the key
+// comes back. Lookups binary search the blocks by first key and scan one
+// block without decoding it.
+class front_coded_keys {
+public:
+  static constexpr uint32_t no_key = UINT32_MAX;
+  static constexpr size_t block_keys = 16;
+
+private:
+  struct block {
+    std::string first;
+    std::string packed;
+    std::vector<uint32_t> ids;
+  };
+
+  using delta_t = std::map<std::string, uint32_t>;
+
+  // Where a key id is: a block slot, the delta map (block == in_delta) or
+  // the free list (block == unused, index is the next free id).
+  struct location {
+    uint32_t block;
+    uint32_t index;
+    delta_t::const_iterator delta_it;
+  };
+
+  static constexpr uint32_t in_delta = UINT32_MAX;
+  static constexpr uint32_t unused = UINT32_MAX - 1;
+
+  std::vector<block> blocks;
+  delta_t delta;
+  std::vector<location> locations;
+  uint32_t free_head;
+  size_t live;
+  size_t removed;
+
+  static void put_varint(std::string &out, size_t n) {
+    while (n >= 0x80) {
+      out.push_back(char((n & 0x7f) | 0x80));
+      n >>= 7;
+    }
+    out.push_back(char(n));
+  }
+
+  static size_t get_varint(std::string const &in, size_t &pos) noexcept {
+    size_t n = 0;
+    for (int shift = 0;; shift += 7) {
+      unsigned char c = static_cast<unsigned char>(in[pos++]);
+      n |= size_t(c & 0x7f) << shift;
+      if (c < 0x80)
+        return n;
+    }
+  }
+
+  static size_t common_prefix(char const *a, size_t a_size, char const *b, size_t b_size) noexcept {
+    size_t n = std::min(a_size, b_size);
+    size_t i = 0;
+    while (i < n && a[i] == b[i])
+      ++i;
+    return i;
+  }
+
+  // Block and slot of k, or false. The scan keeps the length m that the
+  // current key shares with k: a following key sharing more with its
+  // predecessor is still below k, one sharing less is above it, and only
+  // one sharing exactly m needs its suffix compared.
+  bool find_slot(std::string const &k, size_t &b, size_t &i) const noexcept {
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), k, [](std::string const &x, block const &bl) {
+      return x < bl.first;
+    });
+    if (it == blocks.begin())
+      return false;
+    b = size_t(it - blocks.begin()) - 1;
+    block const &bl = blocks[b];
+    size_t m = common_prefix(bl.first.data(), bl.first.size(), k.data(), k.size());
+    if (m == k.size() && m == bl.first.size()) {
+      i = 0;
+      return true;
+    }
+
+    size_t pos = 0;
+    for (i = 1; i < bl.ids.size(); ++i) {
+      size_t shared = get_varint(bl.packed, pos);
+      size_t n = get_varint(bl.packed, pos);
+      char const *suffix = bl.packed.data() + pos;
+      pos += n;
+      if (shared > m)
+        continue;
+      if (shared < m)
+        return false;
+      size_t j = common_prefix(suffix, n, k.data() + m, k.size() - m);
+      if (j == n && m + j == k.size())
+        return true;
+      if (j == n || (m + j < k.size() && static_cast<unsigned char>(suffix[j]) < static_cast<unsigned char>(k[m + j])))
+        m += j;
+      else
+        return false;
+    }
+    return false;
+  }
+
+  uint32_t new_id() {
+    if (free_head != no_key) {
+      uint32_t id = free_head;
+      free_head = locations[id].index;
+      return id;
+    }
+    locations.push_back(location{unused, 0, delta.end()});
+    return uint32_t(locations.size() - 1);
+  }
+
+  void free_id(uint32_t id) noexcept {
+    locations[id].block = unused;
+    locations[id].index = free_head;
+    free_head = id;
+  }
+
+  // Rebuilds the blocks from the live keys of the blocks and the delta.
+  // Nothing changes if it fails to allocate.
+  void merge() {
+    std::vector<std::pair<std::string, uint32_t>> sorted;
+    sorted.reserve(live);
+    auto d = delta.begin();
+    for (auto const &bl : blocks) {
+      std::string key = bl.first;
+      size_t pos = 0;
+      for (size_t i = 0; i < bl.ids.size(); ++i) {
+        if (i != 0) {
+          size_t shared = get_varint(bl.packed, pos);
+          size_t n = get_varint(bl.packed, pos);
+          key.resize(shared);
+          key.append(bl.packed, pos, n);
+          pos += n;
+        }
+        if (bl.ids[i] == no_key)
+          continue;
+        for (; d != delta.end() && d->first < key; ++d)
+          sorted.emplace_back(d->first, d->second);
+        sorted.emplace_back(key, bl.ids[i]);
+      }
+    }
+    for (; d != delta.end(); ++d)
+      sorted.emplace_back(d->first, d->second);
+
+    std::vector<block> fresh((sorted.size() + block_keys - 1) / block_keys);
+    for (size_t s = 0; s < sorted.size(); ++s) {
+      block &bl = fresh[s / block_keys];
+      if (s % block_keys == 0) {
+        bl.first = sorted[s].first;
+        bl.ids.reserve(std::min(block_keys, sorted.size() - s));
+      }
+      else {
+        std::string const &prev = sorted[s - 1].first;
+        std::string const &key = sorted[s].first;
+        size_t shared = common_prefix(prev.data(), prev.size(), key.data(), key.size());
+        put_varint(bl.packed, shared);
+        put_varint(bl.packed, key.size() - shared);
+        bl.packed.append(key, shared, std::string::npos);
+      }
+      bl.ids.push_back(sorted[s].second);
+    }
+    for (auto &bl : fresh)
+      bl.packed.shrink_to_fit();
+
+    blocks.swap(fresh);
+    delta.clear();
+    removed = 0;
+    for (size_t s = 0; s < sorted.size(); ++s)
+      locations[sorted[s].second] = location{uint32_t(s / block_keys), uint32_t(s % block_keys), delta.end()};
+  }
+
+public:
+  class const_iterator {
+  friend class front_coded_keys;
+
+  private:
+    front_coded_keys const *owner;
+    size_t b;
+    size_t i;
+    size_t pos;
+    std::string key;
+    delta_t::const_iterator d;
+
+    bool in_blocks() const noexcept {
+      return b < owner->blocks.size();
+    }
+
+    bool from_blocks() const noexcept {
+      return in_blocks() && (d == owner->delta.end() || key < d->first);
+    }
+
+    // Decodes slot i of block b into key, moving to the next block past
+    // the last slot.
+    void load() {
+      while (in_blocks()) {
+        block const &bl = owner->blocks[b];
+        if (i == bl.ids.size()) {
+          ++b;
+          i = 0;
+          pos = 0;
+          continue;
+        }
+        if (i == 0) {
+          key = bl.first;
+        }
+        else {
+          size_t shared = get_varint(bl.packed, pos);
+          size_t n = get_varint(bl.packed, pos);
+          key.resize(shared);
+          key.append(bl.packed, pos, n);
+          pos += n;
+        }
+        if (bl.ids[i] != no_key)
+          return;
+        ++i;
+      }
+    }
+
+    const_iterator(front_coded_keys const *o, bool at_end)
+        : owner(o), b(at_end ? o->blocks.size() : 0), i(0), pos(0),
+          d(at_end ? o->delta.end() : o->delta.begin()) {
+      load();
+    }
+
+  public:
+    const_iterator() : owner(nullptr), b(0), i(0), pos(0) {
+    }
+
+    const_iterator& operator++() {
+      if (from_blocks()) {
+        ++i;
+        load();
+      }
+      else {
+        ++d;
+      }
+      return *this;
+    }
+
+    bool operator==(const_iterator const &k) const noexcept {
+      return owner == k.owner && b == k.b && i == k.i && d == k.d;
+    }
+
+    bool operator!=(const_iterator const &k) const noexcept {
+      return !(*this == k);
+    }
+
+    std::string const &operator*() const noexcept {
+      return from_blocks() ? key : d->first;
+    }
+
+  };
+
+  front_coded_keys() : free_head(no_key), live(0), removed(0) {
+  }
+
+  front_coded_keys(front_coded_keys const &o)
+      : blocks(o.blocks), delta(o.delta), locations(o.locations), free_head(o.free_head),
+        live(o.live), removed(o.removed) {
+    for (auto &l : locations)
+      l.delta_it = delta.end();
+    for (auto it = delta.begin(); it != delta.end(); ++it)
+      locations[it->second].delta_it = it;
+  }
+
+  front_coded_keys &operator=(front_coded_keys const &) = delete;
+
+  uint32_t find(std::string const &k) const {
+    auto it = delta.find(k);
+    if (it != delta.end())
+      return it->second;
+    size_t b, i;
+    return find_slot(k, b, i) ? blocks[b].ids[i] : no_key;
+  }
+
+  // Adds k, which must be absent, and returns its id.
+  uint32_t insert(std::string const &k) {
+    size_t b, i;
+    if (find_slot(k, b, i)) {
+      uint32_t id = new_id();
+      blocks[b].ids[i] = id;
+      locations[id] = location{uint32_t(b), uint32_t(i), delta.end()};
+      --removed;
+      ++live;
+      return id;
+    }
+
+    if (delta.size() >= std::max<size_t>(64, live / 8))
+      merge();
+    uint32_t id = new_id();
+    try {
+      locations[id] = location{in_delta, 0, delta.emplace(k, id).first};
+    }
+    catch (...) {
+      free_id(id);
+      throw;
+    }
+    ++live;
+    return id;
+  }
+
+  void erase(uint32_t id) noexcept {
+    location &l = locations[id];
+    if (l.block == in_delta) {
+      delta.erase(l.delta_it);
+    }
+    else {
+      blocks[l.block].ids[l.index] = no_key;
+      ++removed;
+    }
+    free_id(id);
+    --live;
+
+    if (removed > 64 && removed > live) {
+      try {
+        merge();
+      }
+      catch (...) {
+      }
+    }
+  }
+
+  // Writes the key with the given id to out.
+  void key(uint32_t id, std::string &out) const {
+    location const &l = locations[id];
+    if (l.block == in_delta) {
+      out = l.delta_it->first;
+      return;
+    }
+    block const &bl = blocks[l.block];
+    out = bl.first;
+    size_t pos = 0;
+    for (size_t i = 1; i <= l.index; ++i) {
+      size_t shared = get_varint(bl.packed, pos);
+      size_t n = get_varint(bl.packed, pos);
+      out.resize(shared);
+      out.append(bl.packed, pos, n);
+      pos += n;
+    }
+  }
+
+  size_t size() const noexcept {
+    return live;
+  }
+
+  // One past the largest id handed out.
+  size_t ids() const noexcept {
+    return locations.size();
+  }
+
+  void clear() noexcept {
+    blocks.clear();
+    delta.clear();
+    locations.clear();
+    free_head = no_key;
+    live = 0;
+    removed = 0;
+  }
+
+  // Approximate heap and inline bytes, for sizing.
+  size_t bytes() const noexcept {
+    size_t n = sizeof(*this) + blocks.capacity() * sizeof(block) + locations.capacity() * sizeof(location);
+    for (auto const &bl : blocks) {
+      if (bl.first.capacity() >= sizeof(std::string))
+        n += bl.first.capacity() + 1;
+      n += bl.packed.capacity() + bl.ids.capacity() * sizeof(uint32_t);
+    }
+    for (auto const &d : delta)
+      n += 4 * sizeof(void *) + sizeof(d) + (d.first.capacity() >= sizeof(std::string) ? d.first.capacity() + 1 : 0);
+    return n;
+  }
+
+  const_iterator begin() const {
+    return const_iterator(this, false);
+  }
+
+  const_iterator end() const {
+    return const_iterator(this, true);
+  }
+};
+
+// keyed_queue for std::string keys with the key index in a
+// front_coded_keys instead of a std::map, for large sets of long keys with
+// shared prefixes (URLs, paths): each distinct key costs its suffix, a few
+// bytes of lengths and id, and its entry list header, instead of a whole
+// copy and a map node. Entries refer to their key by id.
+//
+// Keys are decoded on demand, so front(), back() and the first(k) family
+// return the key by value, next to a reference to the value; lookups scan
+// one block. Otherwise the interface and copy-on-write sharing are those of
+// keyed_queue.
+template <class V>
+class compact_keyed_queue {
+private:
+  using K = std::string;
+  using CKey_Value = std::pair<K, V &>;
+  using CKey_CValue = std::pair<K, V const &>;
+
+  class base_queue;
+  using alloc_t = std::allocator<base_queue>;
+
+  class base_queue {
+  private:
+    struct entry {
+      uint32_t key;
+      V value;
+    };
+
+    using queue_t = std::list<entry>;
+    using keys_t = std::list<typename queue_t::iterator>;
+
+    front_coded_keys keys;
+    queue_t queue;
+    std::vector<keys_t> lists;
+    bool unshareable;
+
+    // A key push() inserted may have no list yet, if growing lists failed.
+    void erase_key(uint32_t id) noexcept {
+      if (id < lists.size())
+        lists[id].clear();
+      keys.erase(id);
+    }
+
+    K key_of(entry const &e) const {
+      K key;
+      keys.key(e.key, key);
+      return key;
+    }
+
+  public:
+    explicit base_queue(alloc_t const &) : unshareable(false) {
+    }
+
+    base_queue(base_queue const &b)
+        : keys(b.keys), queue(b.queue), lists(b.lists.size()), unshareable(false) {
+      KEYED_QUEUE_CLONE(b.queue.size());
+      KEYED_QUEUE_VISIT(2 * b.queue.size());
+      for (auto queue_it = queue.begin(); queue_it != queue.end(); ++queue_it)
+        lists[queue_it->key].push_back(queue_it);
+    }
+
+    alloc_t get_allocator() const {
+      return alloc_t();
+    }
+
+    bool get_unshareable() const {
+      return unshareable;
+    }
+
+    void set_unshareable() {
+      unshareable = true;
+    }
+
+    void check_empty() const {
+      if (queue.empty())
+        keyed_queue_fail(this);
+    }
+
+    uint32_t check_no_key(K const &k) const {
+      uint32_t id = keys.find(k);
+      if (id == front_coded_keys::no_key)
+        keyed_queue_fail(this);
+      return id;
+    }
+
+    void push(K const &k, V const &v) {
+      uint32_t id = keys.find(k);
+      bool added = id == front_coded_keys::no_key;
+      if (added)
+        id = keys.insert(k);
+      try {
+        if (lists.size() <= id)
+          lists.resize(keys.ids());
+        queue.push_back(entry{id, v});
+        try {
+          lists[id].push_back(--queue.end());
+        }
+        catch (...) {
+          queue.pop_back();
+          throw;
+        }
+      }
+      catch (...) {
+        if (added)
+          erase_key(id);
+        throw;
+      }
+    }
+
+    void pop() {
+      uint32_t id = queue.back().key;
+      queue.pop_back();
+      if (lists[id].size() == 1)
+        erase_key(id);
+      else
+        lists[id].pop_back();
+    }
+
+    // The operations on a key take its id from check_no_key(), which a
+    // clone keeps, so the wrapper looks the key up once.
+    void pop(uint32_t id) {
+      queue.erase(lists[id].back());
+      if (lists[id].size() == 1)
+        erase_key(id);
+      else
+        lists[id].pop_back();
+    }
+
+    void move_to_back(uint32_t id) {
+      for (auto queue_it : lists[id])
+        queue.splice(queue.cend(), queue, queue_it);
+    }
+
+    CKey_Value front() {
+      return CKey_Value(key_of(queue.front()), queue.front().value);
+    }
+
+    CKey_Value back() {
+      return CKey_Value(key_of(queue.back()), queue.back().value);
+    }
+
+    CKey_CValue front() const {
+      return CKey_CValue(key_of(queue.front()), queue.front().value);
+    }
+
+    CKey_CValue back() const {
+      return CKey_CValue(key_of(queue.back()), queue.back().value);
+    }
+
+    CKey_Value first(K const &k, uint32_t id) {
+      return CKey_Value(k, lists[id].front()->value);
+    }
+
+    CKey_Value last(K const &k, uint32_t id) {
+      return CKey_Value(k, lists[id].back()->value);
+    }
+
+    CKey_CValue first(K const &k, uint32_t id) const {
+      return CKey_CValue(k, lists[id].front()->value);
+    }
+
+    CKey_CValue last(K const &k, uint32_t id) const {
+      return CKey_CValue(k, lists[id].back()->value);
+    }
+
+    size_t size() const noexcept {
+      return queue.size();
+    }
+
+    bool empty() const noexcept {
+      return queue.empty();
+    }
+
+    void clear() noexcept {
+      queue.clear();
+      lists.clear();
+      keys.clear();
+    }
+
+    size_t count(K const &k) const {
+      uint32_t id = keys.find(k);
+      return id == front_coded_keys::no_key ? 0 : lists[id].size();
+    }
+
+    template <class F>
+    void for_each(F &f) const {
+      K key;
+      for (auto const &e : queue) {
+        keys.key(e.key, key);
+        f(static_cast<K const &>(key), e.value);
+      }
+    }
+
+    size_t index_bytes() const noexcept {
+      return keys.bytes() + lists.capacity() * sizeof(keys_t);
+    }
+
+    front_coded_keys const &key_index() const noexcept {
+      return keys;
+    }
+  };
+
+  keyed_queue_cow<base_queue, alloc_t> queue_ptr;
+
+public:
+  using k_iterator = front_coded_keys::const_iterator;
+
+  compact_keyed_queue() : queue_ptr(alloc_t()) {
+  }
+
+  void push(K const &k, V const &v) {
+    queue_ptr.write([&](base_queue &b) {
+      b.push(k, v);
+    });
+  }
+
+  void pop() {
+    queue_ptr->check_empty();
+    queue_ptr.write([](base_queue &b) {
+      b.pop();
+    });
+  }
+
+  void pop(K const &k) {
+    uint32_t id = queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.pop(id);
+    });
+  }
+
+  void move_to_back(K const &k) {
+    uint32_t id = queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.move_to_back(id);
+    });
+  }
+
+  CKey_Value front() {
+    queue_ptr->check_empty();
+    return queue_ptr.mutate().front();
+  }
+
+  CKey_Value back() {
+    queue_ptr->check_empty();
+    return queue_ptr.mutate().back();
+  }
+
+  CKey_CValue front() const {
+    queue_ptr->check_empty();
+    return queue_ptr->front();
+  }
+
+  CKey_CValue back() const {
+    queue_ptr->check_empty();
+    return queue_ptr->back();
+  }
+
+  CKey_Value first(K const &k) {
+    uint32_t id = queue_ptr->check_no_key(k);
+    return queue_ptr.mutate().first(k, id);
+  }
+
+  CKey_Value last(K const &k) {
+    uint32_t id = queue_ptr->check_no_key(k);
+    return queue_ptr.mutate().last(k, id);
+  }
+
+  CKey_CValue first(K const &k) const {
+    uint32_t id = queue_ptr->check_no_key(k);
+    return queue_ptr->first(k, id);
+  }
+
+  CKey_CValue last(K const &k) const {
+    uint32_t id = queue_ptr->check_no_key(k);
+    return queue_ptr->last(k, id);
+  }
+
+  size_t size() const noexcept {
+    return queue_ptr->size();
+  }
+
+  bool empty() const noexcept {
+    return queue_ptr->empty();
+  }
+
+  void clear() {
+    queue_ptr.clear();
+  }
+
+  size_t count(K const &k) const {
+    return queue_ptr->count(k);
+  }
+
+  // Calls f(k, v) for every element, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    queue_ptr->for_each(f);
+  }
+
+  // Approximate bytes of the key index and per-key entry list headers.
+  size_t index_bytes() const noexcept {
+    return queue_ptr->index_bytes();
+  }
+
+  k_iterator k_begin() const {
+    return queue_ptr->key_index().begin();
+  }
+
+  k_iterator k_end() const {
+    return queue_ptr->key_index().end();
+  }
+
+};
+
+#endif /* COMPACT_KEYED_QUEUE_H */
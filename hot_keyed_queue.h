@@ -0,0 +1,370 @@
+#ifndef HOT_KEYED_QUEUE_H
+#define HOT_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <list>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+
+// Keys ordered by count in a list of buckets, one per distinct count, each
+// holding the keys with that count, as in O(1) LFU caches: a key moves to a
+// neighbouring bucket on increment or decrement, so both are O(1), and the
+// heaviest keys are read off the last buckets.
+//
+// With a capacity, at most that many keys are tracked and an unseen key
+// replaces one with the smallest count, inheriting it as its error
+// (Space-Saving). Over increments alone, counts are then overestimates by
+// at most error, and every key incremented more than increments / capacity
+// times is tracked. Decrements void those two bounds: a key evicted while
+// it still had entries can come back under its live count. What holds
+// throughout is that count - error never exceeds the key's live count,
+// since a decrement clamps the count at the entries the key has left and
+// drops a key that has none, so a key no longer present is never reported
+// as hot.
+template <class K, class Hash = std::hash<K>>
+class key_counts {
+public:
+  struct hot_key {
+    K key;
+    size_t count;
+    size_t error;
+  };
+
+private:
+  struct bucket {
+    size_t count;
+    std::list<K const *> keys;
+  };
+
+  using buckets_t = std::list<bucket>;
+
+  struct entry {
+    typename buckets_t::iterator bucket;
+    typename std::list<K const *>::iterator position;
+    size_t error;
+  };
+
+  using entries_t = std::unordered_map<K, entry, Hash>;
+
+  buckets_t buckets;
+  entries_t entries;
+  size_t capacity;
+
+  // Bucket for count, created next to it (before next) if missing.
+  typename buckets_t::iterator bucket_at(typename buckets_t::iterator next, size_t count) {
+    if (next != buckets.begin() && std::prev(next)->count == count)
+      return std::prev(next);
+    if (next != buckets.end() && next->count == count)
+      return next;
+    return buckets.insert(next, bucket{count, {}});
+  }
+
+  void move(entry &e, typename buckets_t::iterator to) {
+    auto from = e.bucket;
+    to->keys.splice(to->keys.end(), from->keys, e.position);
+    e.bucket = to;
+    if (from->keys.empty())
+      buckets.erase(from);
+  }
+
+  void remove(typename entries_t::iterator it) {
+    auto from = it->second.bucket;
+    from->keys.erase(it->second.position);
+    if (from->keys.empty())
+      buckets.erase(from);
+    entries.erase(it);
+  }
+
+  void collect(std::vector<hot_key> &out, size_t n, size_t at_least) const {
+    for (auto b = buckets.rbegin(); b != buckets.rend() && b->count >= at_least; ++b)
+      for (auto k = b->keys.rbegin(); k != b->keys.rend(); ++k) {
+        if (out.size() == n)
+          return;
+        out.push_back(hot_key{**k, b->count, entries.find(**k)->second.error});
+      }
+  }
+
+public:
+  // A capacity of 0 tracks every key exactly.
+  explicit key_counts(size_t c = 0, Hash const &h = Hash()) : entries(0, h), capacity(c) {
+  }
+
+  key_counts(key_counts const &o) : entries(0, o.entries.hash_function()), capacity(o.capacity) {
+    for (auto const &b : o.buckets) {
+      buckets.push_back(bucket{b.count, {}});
+      for (auto k : b.keys) {
+        auto e = entries.emplace(*k, entry{--buckets.end(), {}, o.entries.find(*k)->second.error}).first;
+        e->second.position = buckets.back().keys.insert(buckets.back().keys.end(), &(e->first));
+      }
+    }
+  }
+
+  key_counts &operator=(key_counts o) {
+    buckets.swap(o.buckets);
+    entries.swap(o.entries);
+    std::swap(capacity, o.capacity);
+    return *this;
+  }
+
+  void increment(K const &k) {
+    auto it = entries.find(k);
+    if (it != entries.end()) {
+      auto next = std::next(it->second.bucket);
+      move(it->second, bucket_at(next, it->second.bucket->count + 1));
+      return;
+    }
+
+    size_t error = 0;
+    if (capacity != 0 && entries.size() == capacity) {
+      error = buckets.front().count;
+      remove(entries.find(*buckets.front().keys.front()));
+    }
+
+    auto next = buckets.begin();
+    while (next != buckets.end() && next->count <= error)
+      ++next;
+    auto to = bucket_at(next, error + 1);
+    auto e = entries.emplace(k, entry{to, {}, error}).first;
+    try {
+      e->second.position = to->keys.insert(to->keys.end(), &(e->first));
+    }
+    catch (...) {
+      entries.erase(e);
+      if (to->keys.empty())
+        buckets.erase(to);
+      throw;
+    }
+  }
+
+  // Lowers k's count by one, and to at most live, the entries k has left,
+  // dropping k at 0. O(1) unless the count is clamped, which passes the
+  // buckets in between. Untracked keys are ignored, which only happens with
+  // a capacity.
+  void decrement(K const &k, size_t live = size_t(-1)) {
+    auto it = entries.find(k);
+    if (it == entries.end())
+      return;
+    size_t count = std::min(it->second.bucket->count - 1, live);
+    if (count == 0) {
+      remove(it);
+      return;
+    }
+    auto next = it->second.bucket;
+    while (next != buckets.begin() && std::prev(next)->count > count)
+      --next;
+    move(it->second, bucket_at(next, count));
+    it->second.error = std::min(it->second.error, count);
+  }
+
+  // Tracks k at count with error, as it was before a decrement that has to
+  // be undone. O(buckets).
+  void reset(K const &k, size_t count, size_t error) {
+    erase(k);
+    auto next = buckets.begin();
+    while (next != buckets.end() && next->count < count)
+      ++next;
+    auto to = bucket_at(next, count);
+    auto e = entries.emplace(k, entry{to, {}, error}).first;
+    try {
+      e->second.position = to->keys.insert(to->keys.end(), &(e->first));
+    }
+    catch (...) {
+      entries.erase(e);
+      if (to->keys.empty())
+        buckets.erase(to);
+      throw;
+    }
+  }
+
+  void erase(K const &k) {
+    auto it = entries.find(k);
+    if (it != entries.end())
+      remove(it);
+  }
+
+  void clear() noexcept {
+    entries.clear();
+    buckets.clear();
+  }
+
+  size_t count(K const &k) const {
+    auto it = entries.find(k);
+    return it == entries.end() ? 0 : it->second.bucket->count;
+  }
+
+  size_t error(K const &k) const {
+    auto it = entries.find(k);
+    return it == entries.end() ? 0 : it->second.error;
+  }
+
+  size_t tracked() const noexcept {
+    return entries.size();
+  }
+
+  // Up to n keys with the highest counts, heaviest first.
+  std::vector<hot_key> top_keys(size_t n) const {
+    std::vector<hot_key> out;
+    collect(out, n, 0);
+    return out;
+  }
+
+  // Keys with count at least c, heaviest first. With a capacity, a key with
+  // count - error >= c certainly qualifies.
+  std::vector<hot_key> keys_with_count_at_least(size_t c) const {
+    std::vector<hot_key> out;
+    collect(out, size_t(-1), c);
+    return out;
+  }
+};
+
+// keyed_queue that keeps key_counts in step with its contents, for finding
+// the keys that dominate it without walking every key.
+template <class K, class V, class Alloc = std::allocator<std::pair<const K, V>>,
+          class Hash = std::hash<K>>
+class hot_keyed_queue {
+private:
+  using queue_type = keyed_queue<K, V, Alloc>;
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  queue_type queue;
+  key_counts<K, Hash> counts;
+
+  queue_type const &view() const noexcept {
+    return queue;
+  }
+
+public:
+  using k_iterator = typename queue_type::k_iterator;
+  using hot_key = typename key_counts<K, Hash>::hot_key;
+
+  // capacity as for key_counts: 0 counts exactly, otherwise Space-Saving
+  // over that many keys, with counts clamped at the live count on pops.
+  explicit hot_keyed_queue(size_t capacity = 0, Alloc const &a = Alloc())
+      : queue(a), counts(capacity) {
+  }
+
+  void push(K const &k, V const &v) {
+    queue.push(k, v);
+    try {
+      counts.increment(k);
+    }
+    catch (...) {
+      queue.pop(k);
+      throw;
+    }
+  }
+
+  void pop() {
+    K k = view().back().first;
+    size_t count = counts.count(k);
+    size_t error = counts.error(k);
+    counts.decrement(k, queue.count(k) - 1);
+    try {
+      queue.pop();
+    }
+    catch (...) {
+      if (count != 0)
+        counts.reset(k, count, error);
+      throw;
+    }
+  }
+
+  void pop(K const &k) {
+    size_t live = queue.count(k);
+    if (live == 0)
+      keyed_queue_fail(this);
+    size_t count = counts.count(k);
+    size_t error = counts.error(k);
+    counts.decrement(k, live - 1);
+    try {
+      queue.pop(k);
+    }
+    catch (...) {
+      if (count != 0)
+        counts.reset(k, count, error);
+      throw;
+    }
+  }
+
+  void move_to_back(K const &k) {
+    queue.move_to_back(k);
+  }
+
+  CKey_Value front() {
+    return queue.front();
+  }
+
+  CKey_Value back() {
+    return queue.back();
+  }
+
+  CKey_CValue front() const {
+    return queue.front();
+  }
+
+  CKey_CValue back() const {
+    return queue.back();
+  }
+
+  CKey_Value first(K const &k) {
+    return queue.first(k);
+  }
+
+  CKey_Value last(K const &k) {
+    return queue.last(k);
+  }
+
+  CKey_CValue first(K const &k) const {
+    return queue.first(k);
+  }
+
+  CKey_CValue last(K const &k) const {
+    return queue.last(k);
+  }
+
+  size_t count(K const &k) const {
+    return queue.count(k);
+  }
+
+  size_t size() const noexcept {
+    return queue.size();
+  }
+
+  bool empty() const noexcept {
+    return queue.empty();
+  }
+
+  void clear() {
+    queue.clear();
+    counts.clear();
+  }
+
+  std::vector<hot_key> top_keys(size_t n) const {
+    return counts.top_keys(n);
+  }
+
+  std::vector<hot_key> keys_with_count_at_least(size_t c) const {
+    return counts.keys_with_count_at_least(c);
+  }
+
+  key_counts<K, Hash> const &key_count_index() const noexcept {
+    return counts;
+  }
+
+  k_iterator k_begin() const noexcept {
+    return queue.k_begin();
+  }
+
+  k_iterator k_end() const noexcept {
+    return queue.k_end();
+  }
+};
+
+#endif /* HOT_KEYED_QUEUE_H */
@@ -0,0 +1,410 @@
+#ifndef INDEXED_KEYED_QUEUE_H
+#define INDEXED_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <map>
+#include <list>
+#include <tuple>
+#include <memory>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+
+// Declarations of secondary indexes over a projection of the value, e.g.
+//
+//   struct by_correlation {};
+//   struct correlation_of {
+//     uint64_t operator()(message const &m) const { return m.correlation; }
+//   };
+//   indexed_keyed_queue<std::string, message,
+//                       indexed_by<hashed_index<by_correlation, correlation_of>>> q;
+//   q.erase_by<by_correlation>(42);
+//
+// Several entries may share a projected value.
+struct keyed_queue_hash {
+  template <class T>
+  size_t operator()(T const &t) const {
+    return std::hash<T>()(t);
+  }
+};
+
+template <class Tag, class Projection, class Hash = keyed_queue_hash,
+          class Equal = std::equal_to<>>
+struct hashed_index {
+  using tag = Tag;
+  using projection = Projection;
+
+  template <class Field, class T, class Alloc>
+  using container = std::unordered_multimap<Field, T, Hash, Equal, Alloc>;
+};
+
+template <class Tag, class Projection, class Less = std::less<>>
+struct ordered_index {
+  using tag = Tag;
+  using projection = Projection;
+
+  template <class Field, class T, class Alloc>
+  using container = std::multimap<Field, T, Less, Alloc>;
+};
+
+template <class... Indexes>
+struct indexed_by {
+};
+
+// keyed_queue with secondary indexes, each mapping a projection of the
+// value to its entries. Every mutation and the copy-on-write clone keep
+// them consistent. Entries remember their place in their key's list and in
+// every index, so find_by is O(1) or O(log n) for hashed and ordered
+// indexes and erase_by removes each entry in O(log n) wherever it is.
+//
+// The projected fields must not be changed through references returned
+// by the queue; the indexes would go stale.
+template <class K, class V, class Indexes, class Alloc = std::allocator<std::pair<const K, V>>>
+class indexed_keyed_queue;
+
+template <class K, class V, class... Indexes, class Alloc>
+class indexed_keyed_queue<K, V, indexed_by<Indexes...>, Alloc> {
+private:
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  template <class Tag, size_t I, class... Is>
+  struct index_of;
+
+  template <class Tag, size_t I, class First, class... Rest>
+  struct index_of<Tag, I, First, Rest...>
+      : std::conditional_t<std::is_same<Tag, typename First::tag>::value,
+                           std::integral_constant<size_t, I>, index_of<Tag, I + 1, Rest...>> {
+  };
+
+  template <class Tag, size_t I>
+  struct index_of<Tag, I> {
+    static_assert(!std::is_same<Tag, Tag>::value, "no index with this tag");
+  };
+
+  template <class T>
+  using rebind_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+  template <class Index>
+  using field_t = std::decay_t<std::invoke_result_t<typename Index::projection, V const &>>;
+
+  template <class Index, class QueueIt>
+  using index_t = typename Index::template container<
+      field_t<Index>, QueueIt, rebind_alloc<std::pair<const field_t<Index>, QueueIt>>>;
+
+  // Per entry: its place in its key's list and in every index.
+  template <class QueueIt, class KeysIt>
+  struct indexed_extra {
+    KeysIt position;
+    std::tuple<typename index_t<Indexes, QueueIt>::iterator...> indexed;
+  };
+
+  class base_queue : public keyed_queue_base<K, V, Alloc, indexed_extra> {
+  private:
+    using base = keyed_queue_base<K, V, Alloc, indexed_extra>;
+    using typename base::iterator;
+
+    std::tuple<index_t<Indexes, iterator>...> indexes;
+
+    template <size_t... I>
+    void unindex(iterator it, size_t n, std::index_sequence<I...>) noexcept {
+      ((I < n ? (void) std::get<I>(indexes).erase(std::get<I>(it->indexed)) : void()), ...);
+    }
+
+    // Adds it to every index, or to none if one of them throws.
+    template <size_t... I>
+    void index(iterator it, std::index_sequence<I...> seq) {
+      size_t done = 0;
+      try {
+        ((std::get<I>(it->indexed) = std::get<I>(indexes).emplace(
+              typename std::tuple_element_t<I, std::tuple<Indexes...>>::projection()(it->second), it),
+          ++done), ...);
+      }
+      catch (...) {
+        unindex(it, done, seq);
+        throw;
+      }
+    }
+
+    void index(iterator it) {
+      index(it, std::index_sequence_for<Indexes...>());
+    }
+
+    void unindex(iterator it) noexcept {
+      unindex(it, sizeof...(Indexes), std::index_sequence_for<Indexes...>());
+    }
+
+    // Unlinks one entry from the queue, its key's list and the indexes.
+    void remove(iterator it) {
+      unindex(it);
+      base::erase(it, it->position);
+    }
+
+  public:
+    explicit base_queue(Alloc const &a)
+        : base(a), indexes(index_t<Indexes, iterator>(a)...) {
+    }
+
+    base_queue(base_queue const &b)
+        : base(b), indexes(index_t<Indexes, iterator>(b.get_allocator())...) {
+      for (auto nodes_it = this->nodes.begin(); nodes_it != this->nodes.end(); ++nodes_it)
+        for (auto pos = nodes_it->second.begin(); pos != nodes_it->second.end(); ++pos)
+          (*pos)->position = pos;
+      for (auto it = this->queue.begin(); it != this->queue.end(); ++it)
+        index(it);
+    }
+
+    template <size_t I, class X>
+    auto find_field(X const &x) const {
+      auto &container = std::get<I>(indexes);
+      auto it = container.find(x);
+      if (it == container.end())
+        this->fail();
+      return it->second;
+    }
+
+    void push(K const &k, V const &v) {
+      auto pushed = base::push(k, v);
+      pushed.first->position = pushed.second;
+      try {
+        index(pushed.first);
+      }
+      catch (...) {
+        base::erase(pushed.first, pushed.second);
+        throw;
+      }
+    }
+
+    void pop() {
+      remove(std::prev(this->queue.end()));
+    }
+
+    void pop(K const &k) {
+      auto nodes_it = this->find(k);
+      this->check_nodes_iterator(nodes_it);
+      remove(nodes_it->second.back());
+    }
+
+    size_t pop_all(K const &k) {
+      auto nodes_it = this->find(k);
+      this->check_nodes_iterator(nodes_it);
+      for (auto it : nodes_it->second)
+        unindex(it);
+      return base::pop_all(k);
+    }
+
+    void erase_positions(std::vector<size_t> const &positions) noexcept {
+      auto next = positions.begin();
+      size_t at = 0;
+      for (auto it = this->queue.begin(); next != positions.end(); ++it, ++at)
+        if (at == *next) {
+          unindex(it);
+          ++next;
+        }
+      base::erase_positions(positions);
+    }
+
+    template <size_t I, class X>
+    size_t count_by(X const &x) const {
+      return std::get<I>(indexes).count(x);
+    }
+
+    template <size_t I, class X>
+    CKey_Value find_by(X const &x) {
+      auto it = find_field<I>(x);
+      return CKey_Value(*(it->first), it->second);
+    }
+
+    template <size_t I, class X>
+    CKey_CValue find_by(X const &x) const {
+      auto it = find_field<I>(x);
+      return CKey_CValue(*(it->first), it->second);
+    }
+
+    template <size_t I, class X>
+    size_t erase_by(X const &x) {
+      size_t erased = 0;
+      auto range = std::get<I>(indexes).equal_range(x);
+      while (range.first != range.second) {
+        remove((range.first++)->second);
+        ++erased;
+      }
+      return erased;
+    }
+
+    void clear() noexcept {
+      std::apply([](auto &... index) { (index.clear(), ...); }, indexes);
+      base::clear();
+    }
+  };
+
+  keyed_queue_cow<base_queue, Alloc> queue_ptr;
+
+  template <class Tag>
+  static constexpr size_t index_for = index_of<Tag, 0, Indexes...>::value;
+
+public:
+  using k_iterator = typename base_queue::k_iterator;
+
+  indexed_keyed_queue() : indexed_keyed_queue(Alloc()) {
+  }
+
+  explicit indexed_keyed_queue(Alloc const &a) : queue_ptr(a) {
+  }
+
+  void push(K const &k, V const &v) {
+    queue_ptr.write([&](base_queue &b) {
+      b.push(k, v);
+    });
+  }
+
+  void pop() {
+    queue_ptr->check_empty();
+    queue_ptr.write([](base_queue &b) {
+      b.pop();
+    });
+  }
+
+  void pop(K const &k) {
+    queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.pop(k);
+    });
+  }
+
+  void move_to_back(K const &k) {
+    queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.move_to_back(k);
+    });
+  }
+
+  // Removes every element with key k and returns how many there were.
+  size_t pop_all(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.write([&](base_queue &b) {
+      return b.pop_all(k);
+    });
+  }
+
+  // Removes every element for which pred(k, v) holds and returns how many
+  // there were; the queue is only detached if something matches.
+  template <class Pred>
+  size_t erase_if(Pred pred) {
+    auto positions = queue_ptr->match(pred);
+    if (positions.empty())
+      return 0;
+    queue_ptr.write([&](base_queue &b) {
+      b.erase_positions(positions);
+    });
+    return positions.size();
+  }
+
+  // One of the entries whose projection for index Tag equals x.
+  template <class Tag, class X>
+  CKey_Value find_by(X const &x) {
+    queue_ptr->template find_field<index_for<Tag>>(x);
+    return queue_ptr.mutate().template find_by<index_for<Tag>>(x);
+  }
+
+  template <class Tag, class X>
+  CKey_CValue find_by(X const &x) const {
+    return queue_ptr->template find_by<index_for<Tag>>(x);
+  }
+
+  template <class Tag, class X>
+  size_t count_by(X const &x) const {
+    return queue_ptr->template count_by<index_for<Tag>>(x);
+  }
+
+  // Removes every entry whose projection for index Tag equals x and
+  // returns how many there were.
+  template <class Tag, class X>
+  size_t erase_by(X const &x) {
+    if (queue_ptr->template count_by<index_for<Tag>>(x) == 0)
+      return 0;
+    return queue_ptr.write([&](base_queue &b) {
+      return b.template erase_by<index_for<Tag>>(x);
+    });
+  }
+
+  CKey_Value front() {
+    queue_ptr->check_empty();
+    return queue_ptr.mutate().front();
+  }
+
+  CKey_Value back() {
+    queue_ptr->check_empty();
+    return queue_ptr.mutate().back();
+  }
+
+  CKey_CValue front() const {
+    queue_ptr->check_empty();
+    return queue_ptr->front();
+  }
+
+  CKey_CValue back() const {
+    queue_ptr->check_empty();
+    return queue_ptr->back();
+  }
+
+  CKey_Value first(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.mutate().first(k);
+  }
+
+  CKey_Value last(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.mutate().last(k);
+  }
+
+  CKey_CValue first(K const &k) const {
+    queue_ptr->check_no_key(k);
+    return queue_ptr->first(k);
+  }
+
+  CKey_CValue last(K const &k) const {
+    queue_ptr->check_no_key(k);
+    return queue_ptr->last(k);
+  }
+
+  size_t size() const noexcept {
+    return queue_ptr->size();
+  }
+
+  bool empty() const noexcept {
+    return queue_ptr->empty();
+  }
+
+  void clear() {
+    queue_ptr.clear();
+  }
+
+  size_t count(K const &k) const {
+    return queue_ptr->count(k);
+  }
+
+  Alloc get_allocator() const {
+    return queue_ptr->get_allocator();
+  }
+
+  // Calls f(k, v) for every element, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    queue_ptr->for_each(f);
+  }
+
+  k_iterator k_begin() const noexcept {
+    return queue_ptr->k_begin();
+  }
+
+  k_iterator k_end() const noexcept {
+    return queue_ptr->k_end();
+  }
+
+};
+
+#endif /* INDEXED_KEYED_QUEUE_H */
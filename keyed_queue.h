@@ -3,242 +3,590 @@
 
 #include <map>
 #include <list>
+#include <string>
+#include <vector>
 #include <memory>
+#include <cstdint>
 #include <cstddef>
 #include <utility>
 #include <exception>
+#include <functional>
+#include <type_traits>
+
+#include "keyed_queue_probes.h"
+#include "keyed_queue_trace_events.h"
+
+// With KEYED_QUEUE_COUNT_VISITS defined, every queue element an operation
+// touches and every key comparison in the index is counted per thread, so
+// that tools can check operations against their asymptotic cost. clones
+// counts copy-on-write detaches, and wholesale copies such as
+// adaptive_keyed_queue's migrations, with the elements they copied, since
+// those are the only O(n) work a mutation may do.
+#ifdef KEYED_QUEUE_COUNT_VISITS
+struct keyed_queue_visits {
+  static inline thread_local size_t elements = 0;
+  static inline thread_local size_t comparisons = 0;
+  static inline thread_local size_t clones = 0;
+  static inline thread_local size_t cloned = 0;
+  
+  static void reset() noexcept {
+    elements = 0;
+    comparisons = 0;
+    clones = 0;
+    cloned = 0;
+  }
+};
+
+template <class K>
+struct keyed_queue_counting_less {
+  bool operator()(K const &a, K const &b) const {
+    ++keyed_queue_visits::comparisons;
+    return std::less<K>()(a, b);
+  }
+};
+
+#define KEYED_QUEUE_VISIT(n) (keyed_queue_visits::elements += (n))
+#define KEYED_QUEUE_CLONE(n) (++keyed_queue_visits::clones, keyed_queue_visits::cloned += (n))
+#define KEYED_QUEUE_COMPARISON() (++keyed_queue_visits::comparisons)
+#define KEYED_QUEUE_KEY_LESS(K) keyed_queue_counting_less<K>
+#else
+#define KEYED_QUEUE_VISIT(n) ((void) 0)
+#define KEYED_QUEUE_CLONE(n) ((void) 0)
+#define KEYED_QUEUE_COMPARISON() ((void) 0)
+#define KEYED_QUEUE_KEY_LESS(K) std::less<K>
+#endif
+
+// How keys are stored in the ordered index of a keyed_queue: type is the
+// map key, make(k) builds one, probe(k) is what find() looks k up with and
+// key() gets K back from either.
+template <class K, class Enable = void>
+struct keyed_queue_index_key {
+  using type = K;
+  using less = KEYED_QUEUE_KEY_LESS(K);
+  
+  static K const &make(K const &k) noexcept {
+    return k;
+  }
+  
+  static K const &probe(K const &k) noexcept {
+    return k;
+  }
+  
+  static K const &key(K const &k) noexcept {
+    return k;
+  }
+};
+
+// Strings are stored with their first 8 bytes as a big-endian integer,
+// zero padded, which orders like the strings themselves. Most comparisons
+// are then decided by the integers and the string sizes, inline in the map
+// node, and only keys sharing 8 bytes compare their heap buffers.
+template <class A>
+struct keyed_queue_index_key<std::basic_string<char, std::char_traits<char>, A>> {
+  using K = std::basic_string<char, std::char_traits<char>, A>;
+  
+  struct type {
+    uint64_t prefix;
+    K key;
+  };
+  
+  struct lookup {
+    uint64_t prefix;
+    K const *key;
+  };
+  
+  static uint64_t prefix_of(K const &k) noexcept {
+    uint64_t prefix = 0;
+    size_t n = k.size() < 8 ? k.size() : 8;
+    for (size_t i = 0; i < 8; ++i)
+      prefix = prefix << 8 | (i < n ? uint64_t(static_cast<unsigned char>(k[i])) : 0);
+    return prefix;
+  }
+  
+  static type make(K const &k) {
+    return type{prefix_of(k), k};
+  }
+  
+  static lookup probe(K const &k) noexcept {
+    return lookup{prefix_of(k), &k};
+  }
+  
+  static K const &key(type const &t) noexcept {
+    return t.key;
+  }
+  
+  static K const &key(lookup const &l) noexcept {
+    return *(l.key);
+  }
+  
+  // Equal prefixes with either string within 8 bytes make the shorter
+  // string a prefix of the longer.
+  struct less {
+    using is_transparent = void;
+    
+    template <class X, class Y>
+    bool operator()(X const &x, Y const &y) const {
+      KEYED_QUEUE_COMPARISON();
+      if (x.prefix != y.prefix)
+        return x.prefix < y.prefix;
+      K const &a = key(x);
+      K const &b = key(y);
+      if (a.size() <= 8 || b.size() <= 8)
+        return a.size() < b.size();
+      return a.compare(8, K::npos, b, 8, K::npos) < 0;
+    }
+  };
+};
 
 class lookup_error: public std::exception {
 public:
-  const char *what() {
+  const char *what() const noexcept override {
     return "lookup error";
   }
 };
 
-template <class K, class V>
-class keyed_queue {  
+// Throws lookup_error for the queue representation at queue, firing the
+// lookup_error probe first, for keyed_queue and the queues built on it.
+[[noreturn]] inline void keyed_queue_fail(void const *queue) {
+  KEYED_QUEUE_PROBE1(lookup_error, queue);
+  (void) queue;
+  throw lookup_error();
+}
+
+// Copy-on-write handle to a queue representation Base, shared by
+// keyed_queue and the queues built like it. Copies share the
+// representation until one of them changes it; writable() then hands the
+// writer a clone of its own, or the representation itself if it is not
+// shared, and commit() installs it once the change has succeeded, which
+// keeps a throwing change from touching any copy. A representation that
+// was handed out for writing may have outstanding references into it, so
+// it is marked unshareable and later copies clone it at once.
+//
+// Base needs a constructor from Alloc, a copy constructor that clones,
+// get_allocator(), size(), clear(), get_unshareable() and
+// set_unshareable().
+template <class Base, class Alloc>
+class keyed_queue_cow {
 private:
-  using CKey_Value = std::pair<K const &, V &>;
-  using CKey_CValue = std::pair<K const &, V const &>;
+  std::shared_ptr<Base> ptr;
   
-  class base_queue {
-  private:
-    using queue_t = std::list<std::pair<const K*, V>>;
-    using nodes_t = std::map<K, std::list<typename queue_t::iterator>>;
-    using nodes_it_t = typename nodes_t::const_iterator;
-    
-    nodes_t nodes;
-    queue_t queue;
-    bool unshareable;
-    
-  public:
-    base_queue() : unshareable(false) {
-    }
-    
-    base_queue(base_queue const &b) : queue(b.queue), unshareable(false) {
-      for (auto queue_it = queue.begin(); queue_it != queue.end(); ++queue_it)
-        nodes[*(queue_it->first)].push_back(queue_it);
-      for (auto nodes_it = nodes.begin(); nodes_it != nodes.end(); ++nodes_it)
-        for (auto queue_it : nodes_it->second)
-          queue_it->first = &(nodes_it->first);
-    }
-    
-    bool get_unshareable() {
-      return unshareable;
-    }
-    
-    void set_unshareable() {
-      unshareable = true;
-    }
-          
-    void check_empty() const {
-      if (queue.empty())
-        throw lookup_error();
-    }
+  static std::shared_ptr<Base> clone(Base const &b) {
+    KEYED_QUEUE_PROBE2(detach_start, &b, b.size());
+    auto copy = std::allocate_shared<Base>(b.get_allocator(), b);
+    KEYED_QUEUE_PROBE3(detach_end, &b, copy.get(), copy->size());
+    return copy;
+  }
   
-    void check_no_key(K const& k) const {
-      if (nodes.find(k) == nodes.end())
-        throw lookup_error();
-    }
-    
-    void check_nodes_iterator(nodes_it_t const &it) const {
-      if (it == nodes.end())
-        throw lookup_error();
+public:
+  using pointer = std::shared_ptr<Base>;
+  
+  explicit keyed_queue_cow(Alloc const &a) : ptr(std::allocate_shared<Base>(a, a)) {
+  }
+  
+  keyed_queue_cow(keyed_queue_cow const &o)
+      : ptr(o.ptr->get_unshareable() ? clone(*(o.ptr)) : o.ptr) {
+  }
+  
+  keyed_queue_cow(keyed_queue_cow &&o) noexcept : ptr(o.ptr) {
+  }
+  
+  keyed_queue_cow &operator=(keyed_queue_cow o) noexcept {
+    ptr.swap(o.ptr);
+    return *this;
+  }
+  
+  Base const *operator->() const noexcept {
+    return ptr.get();
+  }
+  
+  Base const &operator*() const noexcept {
+    return *ptr;
+  }
+  
+  pointer writable() {
+    if (ptr.use_count() > 1)
+      return clone(*ptr);
+    ptr->set_unshareable();
+    return ptr;
+  }
+  
+  void commit(pointer &p) noexcept {
+    ptr.swap(p);
+  }
+  
+  // Runs f on a writable representation and commits it if f returns.
+  template <class F>
+  auto write(F f) -> decltype(f(std::declval<Base &>())) {
+    pointer p = writable();
+    if constexpr (std::is_void<decltype(f(*p))>::value) {
+      f(*p);
+      commit(p);
     }
-    
-    void push(K const &, V const &);
-    void pop();
-    void pop(K const &);
-    void move_to_back(K const &);
-    
-    CKey_Value front() {
-      return CKey_Value(*(queue.front().first), queue.front().second);
+    else {
+      auto result = f(*p);
+      commit(p);
+      return result;
     }
+  }
+  
+  // The representation for mutable access to an element.
+  Base &mutate() {
+    ptr = writable();
+    return *ptr;
+  }
+  
+  void clear() {
+    if (ptr.use_count() > 1)
+      ptr = std::allocate_shared<Base>(ptr->get_allocator(), ptr->get_allocator());
+    else
+      ptr->clear();
+  }
+};
+
+template <class QueueIt, class KeysIt>
+struct keyed_queue_no_extra {
+};
+
+// Representation of a keyed_queue: the entries in queue order and an
+// ordered index from every key to the list of its entries, which the
+// copy-on-write handle shares between copies.
+//
+// Queues built on it keep more per entry by passing Extra, a class
+// template instantiated with the entry and key list iterator types that
+// every entry derives from; the default is empty and costs nothing. They
+// derive from keyed_queue_base and replace the mutations whose bookkeeping
+// they extend.
+template <class K, class V, class Alloc, template <class, class> class Extra = keyed_queue_no_extra>
+class keyed_queue_base {
+protected:
+  template <class T>
+  using rebind_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+  
+  struct entry_t;
+  using queue_t = std::list<entry_t, rebind_alloc<entry_t>>;
+  using iterator = typename queue_t::iterator;
+  using keys_t = std::list<iterator, rebind_alloc<iterator>>;
+  using position = typename keys_t::iterator;
+  
+  struct entry_t : Extra<iterator, position> {
+    K const *first;
+    V second;
     
-    CKey_Value back() {
-      return CKey_Value(*(queue.back().first), queue.back().second);
+    entry_t(K const *k, V const &v) : first(k), second(v) {
     }
-    
-    CKey_CValue front() const {
-      return CKey_CValue(*(queue.front().first), queue.front().second);
+  };
+  
+  using index_key = keyed_queue_index_key<K>;
+  using nodes_t = std::map<typename index_key::type, keys_t, typename index_key::less,
+                           rebind_alloc<std::pair<const typename index_key::type, keys_t>>>;
+  using nodes_it_t = typename nodes_t::const_iterator;
+  
+  nodes_t nodes;
+  queue_t queue;
+  bool unshareable;
+  
+  typename nodes_t::iterator find(K const &k) {
+    return nodes.find(index_key::probe(k));
+  }
+  
+  nodes_it_t find(K const &k) const {
+    return nodes.find(index_key::probe(k));
+  }
+  
+  // The key is copied only if it is new.
+  std::pair<typename nodes_t::iterator, bool> find_or_insert(K const &k) {
+    auto nodes_it = nodes.lower_bound(index_key::probe(k));
+    if (nodes_it != nodes.end() && !nodes.key_comp()(index_key::probe(k), nodes_it->first))
+      return {nodes_it, false};
+    return {nodes.emplace_hint(nodes_it, index_key::make(k), queue.get_allocator()), true};
+  }
+  
+  // Unlinks the entry at it, found at pos in its key's list.
+  void erase(iterator it, position pos) {
+    KEYED_QUEUE_VISIT(1);
+    auto nodes_it = find(*(it->first));
+    if (nodes_it->second.size() == 1)
+      nodes.erase(nodes_it);
+    else
+      nodes_it->second.erase(pos);
+    queue.erase(it);
+  }
+  
+public:
+  explicit keyed_queue_base(Alloc const &a) : nodes(a), queue(a), unshareable(false) {
+  }
+  
+  keyed_queue_base(keyed_queue_base const &b)
+      : nodes(b.nodes.get_allocator()), queue(b.queue.get_allocator()), unshareable(false) {
+    KEYED_QUEUE_TRACE_SCOPE("clone");
+    KEYED_QUEUE_CLONE(b.queue.size());
+    KEYED_QUEUE_VISIT(3 * b.queue.size());
+    {
+      KEYED_QUEUE_TRACE_SCOPE("clone list copy");
+      queue.insert(queue.end(), b.queue.begin(), b.queue.end());
     }
-    
-    CKey_CValue back() const {
-      return CKey_CValue(*(queue.back().first), queue.back().second);
+    {
+      KEYED_QUEUE_TRACE_SCOPE("clone index rebuild");
+      for (auto queue_it = queue.begin(); queue_it != queue.end(); ++queue_it)
+        find_or_insert(*(queue_it->first)).first->second.push_back(queue_it);
     }
-    
-    CKey_Value first(K const &k) {
-      auto nodes_it = nodes.find(k);
-      return CKey_Value(*(nodes_it->second.front()->first), nodes_it->second.front()->second);
+    KEYED_QUEUE_TRACE_SCOPE("clone pointer fixup");
+    for (auto nodes_it = nodes.begin(); nodes_it != nodes.end(); ++nodes_it)
+      for (auto queue_it : nodes_it->second)
+        queue_it->first = &index_key::key(nodes_it->first);
+  }
+  
+  Alloc get_allocator() const {
+    return Alloc(queue.get_allocator());
+  }
+  
+  bool get_unshareable() const {
+    return unshareable;
+  }
+  
+  void set_unshareable() {
+    unshareable = true;
+  }
+        
+  [[noreturn]] void fail() const {
+    keyed_queue_fail(this);
+  }
+        
+  void check_empty() const {
+    if (queue.empty())
+      fail();
+  }
+
+  void check_no_key(K const& k) const {
+    if (find(k) == nodes.end())
+      fail();
+  }
+  
+  void check_nodes_iterator(nodes_it_t const &it) const {
+    if (it == nodes.end())
+      fail();
+  }
+  
+  std::pair<iterator, position> push(K const &, V const &);
+  void pop();
+  void pop(K const &);
+  void move_to_back(K const &);
+  void transfer(K const &, keyed_queue_base &);
+  size_t pop_all(K const &);
+  void erase_positions(std::vector<size_t> const &) noexcept;
+  
+  // Positions, in queue order, of the entries pred(k, v) holds for.
+  template <class Pred>
+  std::vector<size_t> match(Pred &pred) const {
+    std::vector<size_t> positions;
+    size_t position = 0;
+    KEYED_QUEUE_VISIT(queue.size());
+    for (auto const &entry : queue) {
+      if (pred(*(entry.first), entry.second))
+        positions.push_back(position);
+      ++position;
     }
+    return positions;
+  }
+  
+  CKey_Value front() {
+    return CKey_Value(*(queue.front().first), queue.front().second);
+  }
+  
+  CKey_Value back() {
+    return CKey_Value(*(queue.back().first), queue.back().second);
+  }
+  
+  CKey_CValue front() const {
+    return CKey_CValue(*(queue.front().first), queue.front().second);
+  }
+  
+  CKey_CValue back() const {
+    return CKey_CValue(*(queue.back().first), queue.back().second);
+  }
+  
+  CKey_Value first(K const &k) {
+    auto nodes_it = find(k);
+    return CKey_Value(*(nodes_it->second.front()->first), nodes_it->second.front()->second);
+  }
+  
+  CKey_Value last(K const &k) {
+    auto nodes_it = find(k);
+    return CKey_Value(*(nodes_it->second.back()->first), nodes_it->second.back()->second);
+  }
+  
+  CKey_CValue first(K const &k) const {
+    auto nodes_it = find(k);
+    return CKey_CValue(*(nodes_it->second.front()->first), nodes_it->second.front()->second);
+  }
+  
+  CKey_CValue last(K const &k) const {
+    auto nodes_it = find(k);
+    return CKey_CValue(*(nodes_it->second.back()->first), nodes_it->second.back()->second);
+  }
+  
+  size_t size() const noexcept {
+    return queue.size();
+  }
+  
+  bool empty() const noexcept {
+    return queue.empty();
+  }
+  
+  void clear() noexcept {
+    KEYED_QUEUE_VISIT(queue.size());
+    nodes.clear();
+    queue.clear();
+  }
+  
+  size_t count(K const &k) const {
+    auto nodes_it = find(k);
+    if (nodes_it == nodes.end())
+      return 0;
+    return nodes_it->second.size();
+  }
+  
+  template <class F>
+  void for_each(F &f) const {
+    for (auto const &entry : queue)
+      f(*(entry.first), entry.second);
+  }
+  
+  class k_iterator {
+  friend class keyed_queue_base;
+  
+  private:
+    nodes_it_t iterator;
     
-    CKey_Value last(K const &k) {
-      auto nodes_it = nodes.find(k);
-      return CKey_Value(*(nodes_it->second.back()->first), nodes_it->second.back()->second);
-    }
+    k_iterator(nodes_it_t it) : iterator(it) {}
     
-    CKey_CValue first(K const &k) const {
-      auto nodes_it = nodes.begin();
-      return CKey_Value(*(nodes_it->second.front()->first), nodes_it->second.front()->second);
+  public:
+    k_iterator() {
     }
     
-    CKey_CValue last(K const &k) const {
-      auto nodes_it = --nodes.end();
-      return CKey_Value(*(nodes_it->second.back()->first), nodes_it->second.back()->second);
+    k_iterator(const k_iterator &k) : iterator(k.iterator) {
     }
     
-    size_t size() const noexcept {
-      return queue.size();
+    k_iterator& operator++() noexcept {
+      ++iterator;
+      return *this;
     }
     
-    bool empty() const noexcept {
-      return queue.empty();
+    bool operator==(k_iterator const &k) const noexcept {
+      return iterator == k.iterator;
     }
     
-    void clear() noexcept {
-      nodes.clear();
-      queue.clear();
+    bool operator!=(k_iterator const &k) const noexcept {
+      return !(*this == k);
     }
     
-    size_t count(K const &k) const {
-      auto nodes_it = nodes.find(k);
-      if (nodes_it == nodes.end())
-        return 0;
-      return nodes_it->second.size();
+    const K& operator*() const noexcept {
+      return index_key::key(iterator->first);
     }
-    
-    class k_iterator {
-    friend class base_queue;
-    
-    private:
-      nodes_it_t iterator;
-      
-      k_iterator(nodes_it_t it) : iterator(it) {}
-      
-    public:
-      k_iterator() {
-      }
-      
-      k_iterator(const k_iterator &k) : iterator(k.iterator) {
-      }
-      
-      k_iterator& operator++() noexcept {
-        ++iterator;
-        return *this;
-      }
-      
-      bool operator==(k_iterator const &k) const noexcept {
-        return iterator == k.iterator;
-      }
-      
-      bool operator!=(k_iterator const &k) const noexcept {
-        return !(*this == k);
-      }
-      
-      const K& operator*() const noexcept {
-        return iterator->first;
-      }
 
-    };
-    
-    k_iterator k_begin() const {
-      return k_iterator(nodes.begin());
-    }
-    
-    k_iterator k_end() const {
-      return k_iterator(nodes.end());
-    }
-  
   };
-
-  std::shared_ptr<base_queue> queue_ptr;
   
-  std::shared_ptr<base_queue> get_base_queue_ptr() {
-    if (queue_ptr.use_count() > 1) {
-      return std::make_shared<base_queue>(*queue_ptr);
-    }
-    else {
-      queue_ptr->set_unshareable();
-      return queue_ptr;
-    }
+  k_iterator k_begin() const {
+    return k_iterator(nodes.begin());
   }
   
+  k_iterator k_end() const {
+    return k_iterator(nodes.end());
+  }
+
+};
+
+template <class K, class V, class Alloc = std::allocator<std::pair<const K, V>>>
+class keyed_queue {  
+private:
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  using base_queue = keyed_queue_base<K, V, Alloc>;
+
+  keyed_queue_cow<base_queue, Alloc> queue_ptr;
+  
 public:
   using k_iterator = typename base_queue::k_iterator;
   
-  keyed_queue() : queue_ptr(std::make_shared<base_queue>()) {
+  keyed_queue() : keyed_queue(Alloc()) {
   }
 
-  keyed_queue(keyed_queue const &k) {
-    if (queue_ptr->get_unshareable()) {
-      queue_ptr = std::make_shared<base_queue>(*(k.queue_ptr));
-    } else {
-      queue_ptr = k.queue_ptr;
-    }
-  }
-  
-  keyed_queue(keyed_queue &&k) noexcept : queue_ptr(k.queue_ptr) {
-  }
-  
-  keyed_queue &operator=(keyed_queue o) {
-    queue_ptr.swap(o.queue_ptr);
-    return *this;
+  explicit keyed_queue(Alloc const &a) : queue_ptr(a) {
   }
-  
+
   void push(K const &k, V const &v) {
-    auto ptr = get_base_queue_ptr();
-    ptr->push(k, v);
-    queue_ptr.swap(ptr);
+    queue_ptr.write([&](base_queue &b) {
+      b.push(k, v);
+    });
   }
 
   void pop() {
-    auto ptr = get_base_queue_ptr();
-    ptr->pop();
-    queue_ptr.swap(ptr);
+    queue_ptr->check_empty();
+    queue_ptr.write([](base_queue &b) {
+      b.pop();
+    });
   }
 
   void pop(K const &k) {
-    auto ptr = get_base_queue_ptr();
-    ptr->pop(k);
-    queue_ptr.swap(ptr);
+    queue_ptr.write([&](base_queue &b) {
+      b.pop(k);
+    });
   }
 
   void move_to_back(K const &k) {
-    auto ptr = get_base_queue_ptr();
-    ptr->move_to_back(k);
-    queue_ptr.swap(ptr);
+    queue_ptr.write([&](base_queue &b) {
+      b.move_to_back(k);
+    });
+  }
+
+  // Removes every element with key k and returns how many there were.
+  size_t pop_all(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.write([&](base_queue &b) {
+      return b.pop_all(k);
+    });
+  }
+
+  // Removes every element for which pred(k, v) holds, in one pass over the
+  // queue and one over the keys, and returns how many there were. pred is
+  // called once per element, in queue order; the queue is only detached if
+  // something matches.
+  template <class Pred>
+  size_t erase_if(Pred pred) {
+    auto positions = queue_ptr->match(pred);
+    if (positions.empty())
+      return 0;
+    queue_ptr.write([&](base_queue &b) {
+      b.erase_positions(positions);
+    });
+    return positions.size();
+  }
+
+  // Moves all elements with key k, in their order, to the back of dst, in
+  // O(count(k)). With equal allocators no element is copied or allocated.
+  void transfer(K const &k, keyed_queue &dst) {
+    queue_ptr->check_no_key(k);
+    if (&dst == this)
+      return;
+    auto ptr = queue_ptr.writable();
+    auto dst_ptr = dst.queue_ptr.writable();
+    ptr->transfer(k, *dst_ptr);
+    queue_ptr.commit(ptr);
+    dst.queue_ptr.commit(dst_ptr);
   }
 
   CKey_Value front() {
     queue_ptr->check_empty();
-    queue_ptr = get_base_queue_ptr();
-    return queue_ptr->front();
+    return queue_ptr.mutate().front();
   }
 
   CKey_Value back() {
     queue_ptr->check_empty();
-    queue_ptr = get_base_queue_ptr();
-    return queue_ptr->back();
+    return queue_ptr.mutate().back();
   }
 
   CKey_CValue front() const {
@@ -253,14 +601,12 @@ public:
 
   CKey_Value first(K const &k) {
     queue_ptr->check_no_key(k);
-    queue_ptr = get_base_queue_ptr();
-    return queue_ptr->first(k);
+    return queue_ptr.mutate().first(k);
   }
 
   CKey_Value last(K const &k) {
     queue_ptr->check_no_key(k);
-    queue_ptr = get_base_queue_ptr();
-    return queue_ptr->last(k);
+    return queue_ptr.mutate().last(k);
   }
 
   CKey_CValue first(K const &k) const {
@@ -282,16 +628,23 @@ public:
   }
 
   void clear() {
-    if (queue_ptr.use_count() > 1)
-      queue_ptr = std::make_shared<base_queue>();
-    else
-      queue_ptr->clear();
+    queue_ptr.clear();
   }
 
   size_t count(K const &k) const {
     return queue_ptr->count(k);
   }
 
+  Alloc get_allocator() const {
+    return queue_ptr->get_allocator();
+  }
+
+  // Calls f(k, v) for every element, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    queue_ptr->for_each(f);
+  }
+
   k_iterator k_begin() const noexcept {
     return queue_ptr->k_begin();
   }
@@ -302,27 +655,42 @@ public:
   
 };
 
-template<class K, class V>
-void keyed_queue<K, V>::base_queue::push(K const &k, V const &v) {
+template <class K, class V, class Alloc, template <class, class> class Extra>
+auto keyed_queue_base<K, V, Alloc, Extra>::push(K const &k, V const &v)
+    -> std::pair<iterator, position> {
+  KEYED_QUEUE_VISIT(1);
   queue.emplace_back(nullptr, v);
   auto queue_it = --queue.end();
-  auto nodes_it = nodes.find(k);
+  typename nodes_t::iterator nodes_it;
   
   try {
-    nodes[k].push_back(queue_it);
+    auto inserted = find_or_insert(k);
+    nodes_it = inserted.first;
+    try {
+      nodes_it->second.push_back(queue_it);
+    }
+    catch (...) {
+      if (inserted.second)
+        nodes.erase(nodes_it);
+      throw;
+    }
   }
   catch (...) {
     queue.pop_back();
     throw;
   }
   
-  queue_it->first = &(nodes_it->first);
+  queue_it->first = &index_key::key(nodes_it->first);
+  KEYED_QUEUE_PROBE3(push, this, queue_it->first, queue.size());
+  return {queue_it, --nodes_it->second.end()};
 }
 
-template<class K, class V>
-void keyed_queue<K, V>::base_queue::pop() {
-  auto nodes_it = nodes.find(*(queue.back().first));
+template <class K, class V, class Alloc, template <class, class> class Extra>
+void keyed_queue_base<K, V, Alloc, Extra>::pop() {
+  KEYED_QUEUE_VISIT(1);
+  auto nodes_it = find(*(queue.back().first));
   check_nodes_iterator(nodes_it);
+  KEYED_QUEUE_PROBE3(pop, this, queue.back().first, queue.size());
   
   queue.pop_back();
   
@@ -332,10 +700,12 @@ void keyed_queue<K, V>::base_queue::pop() {
     nodes_it->second.pop_back();
 }
 
-template<class K, class V>
-void keyed_queue<K, V>::base_queue::pop(K const &k) {
-  auto nodes_it = nodes.find(k);
+template <class K, class V, class Alloc, template <class, class> class Extra>
+void keyed_queue_base<K, V, Alloc, Extra>::pop(K const &k) {
+  KEYED_QUEUE_VISIT(1);
+  auto nodes_it = find(k);
   check_nodes_iterator(nodes_it);
+  KEYED_QUEUE_PROBE3(pop_key, this, &index_key::key(nodes_it->first), queue.size());
   
   queue.erase(nodes_it->second.back());
   
@@ -345,13 +715,102 @@ void keyed_queue<K, V>::base_queue::pop(K const &k) {
     nodes_it->second.pop_back();
 }
 
-template<class K, class V>
-void keyed_queue<K, V>::base_queue::move_to_back(K const &k) {
-  auto nodes_it = nodes.find(k);
+template <class K, class V, class Alloc, template <class, class> class Extra>
+void keyed_queue_base<K, V, Alloc, Extra>::move_to_back(K const &k) {
+  auto nodes_it = find(k);
   check_nodes_iterator(nodes_it);
+  KEYED_QUEUE_PROBE3(move_to_back, this, &index_key::key(nodes_it->first), nodes_it->second.size());
   
+  KEYED_QUEUE_TRACE_SCOPE("move_to_back splice");
+  KEYED_QUEUE_VISIT(nodes_it->second.size());
   for (auto queue_it : nodes_it->second)
     queue.splice(queue.cend(), queue, queue_it);
 }
 
+template <class K, class V, class Alloc, template <class, class> class Extra>
+size_t keyed_queue_base<K, V, Alloc, Extra>::pop_all(K const &k) {
+  auto nodes_it = find(k);
+  check_nodes_iterator(nodes_it);
+  
+  size_t popped = nodes_it->second.size();
+  KEYED_QUEUE_VISIT(popped);
+  for (auto queue_it : nodes_it->second)
+    queue.erase(queue_it);
+  nodes.erase(nodes_it);
+  return popped;
+}
+
+// Entries to erase lose their key pointer first, so that every key's list
+// can then be filtered without looking anything up.
+template <class K, class V, class Alloc, template <class, class> class Extra>
+void keyed_queue_base<K, V, Alloc, Extra>::erase_positions(std::vector<size_t> const &positions) noexcept {
+  KEYED_QUEUE_VISIT(queue.size());
+  auto next = positions.begin();
+  size_t position = 0;
+  for (auto queue_it = queue.begin(); next != positions.end(); ++queue_it, ++position)
+    if (position == *next) {
+      queue_it->first = nullptr;
+      ++next;
+    }
+  
+  for (auto nodes_it = nodes.begin(); nodes_it != nodes.end();) {
+    nodes_it->second.remove_if([](typename queue_t::iterator queue_it) {
+      return queue_it->first == nullptr;
+    });
+    if (nodes_it->second.empty())
+      nodes_it = nodes.erase(nodes_it);
+    else
+      ++nodes_it;
+  }
+  
+  queue.remove_if([](entry_t const &entry) {
+    return entry.first == nullptr;
+  });
+}
+
+template <class K, class V, class Alloc, template <class, class> class Extra>
+void keyed_queue_base<K, V, Alloc, Extra>::transfer(K const &k, keyed_queue_base &dst) {
+  auto nodes_it = find(k);
+  check_nodes_iterator(nodes_it);
+  KEYED_QUEUE_VISIT(nodes_it->second.size());
+  
+  if (queue.get_allocator() != dst.queue.get_allocator()) {
+    size_t pushed = 0;
+    try {
+      for (auto queue_it : nodes_it->second) {
+        dst.push(k, queue_it->second);
+        ++pushed;
+      }
+    }
+    catch (...) {
+      for (; pushed > 0; --pushed)
+        dst.pop(k);
+      throw;
+    }
+    for (auto queue_it : nodes_it->second)
+      queue.erase(queue_it);
+    nodes.erase(nodes_it);
+    return;
+  }
+  
+  // The entries of k are scattered through the queue, so each is unlinked
+  // and spliced on its own; the key's index node, or its list of positions
+  // if dst already has k, moves in one step.
+  KEYED_QUEUE_TRACE_SCOPE("transfer splice");
+  auto dst_it = dst.find(k);
+  if (dst_it == dst.nodes.end()) {
+    for (auto queue_it : nodes_it->second)
+      dst.queue.splice(dst.queue.cend(), queue, queue_it);
+    dst.nodes.insert(nodes.extract(nodes_it));
+    return;
+  }
+  
+  for (auto queue_it : nodes_it->second) {
+    dst.queue.splice(dst.queue.cend(), queue, queue_it);
+    queue_it->first = &index_key::key(dst_it->first);
+  }
+  dst_it->second.splice(dst_it->second.end(), nodes_it->second);
+  nodes.erase(nodes_it);
+}
+
 #endif /* KEYED_QUEUE_H */
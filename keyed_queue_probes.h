@@ -0,0 +1,81 @@
+#ifndef KEYED_QUEUE_PROBES_H
+#define KEYED_QUEUE_PROBES_H
+
+#include <cstdint>
+#include <type_traits>
+
+// USDT (SystemTap-compatible) static tracepoints, enabled by defining
+// KEYED_QUEUE_USDT. Each probe compiles to a single nop plus a
+// .note.stapsdt entry naming the provider, the probe and where its
+// arguments live, which is what bpftrace, perf probe and SystemTap read;
+// there is no runtime library. Otherwise the macros expand to nothing.
+//
+// Provider "keyed_queue", all arguments 64-bit:
+//   push(queue, key*, size)          pop(queue, key*, size)
+//   pop_key(queue, key*, size)       move_to_back(queue, key*, count)
+//   detach_start(queue, size)        detach_end(queue, copy, size)
+//   lookup_error(queue)
+// queue is the address of the shared representation, so it changes when a
+// copy-on-write detach gives the writer a copy of its own.
+//
+//   bpftrace -e 'usdt:./app:keyed_queue:detach_start { @[ustack] = count(); }'
+
+#if defined(KEYED_QUEUE_USDT) && defined(__GNUC__) && defined(__ELF__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+
+template <class T>
+inline uint64_t keyed_queue_probe_arg(T a) noexcept {
+  if constexpr (std::is_pointer<T>::value)
+    return uint64_t(reinterpret_cast<uintptr_t>(a));
+  else
+    return uint64_t(a);
+}
+
+#define KEYED_QUEUE_SDT_NOTE(name, args)                                       \
+  "990: nop\n"                                                                 \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+  ".balign 4\n"                                                                \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                           \
+  "991: .asciz \"stapsdt\"\n"                                                  \
+  "992: .balign 4\n"                                                           \
+  "993: .8byte 990b\n"                                                         \
+  ".8byte _.stapsdt.base\n"                                                    \
+  ".8byte 0\n"                                                                 \
+  ".asciz \"keyed_queue\"\n"                                                   \
+  ".asciz \"" #name "\"\n"                                                     \
+  ".asciz \"" args "\"\n"                                                      \
+  "994: .balign 4\n"                                                           \
+  ".popsection\n"                                                              \
+  ".ifndef _.stapsdt.base\n"                                                   \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"      \
+  ".weak _.stapsdt.base\n"                                                     \
+  ".hidden _.stapsdt.base\n"                                                   \
+  "_.stapsdt.base: .space 1\n"                                                 \
+  ".size _.stapsdt.base, 1\n"                                                  \
+  ".popsection\n"                                                              \
+  ".endif\n"
+
+#define KEYED_QUEUE_PROBE1(name, a)                                            \
+  __asm__ __volatile__(KEYED_QUEUE_SDT_NOTE(name, "8@%0")                      \
+                       :: "nor"(keyed_queue_probe_arg(a)))
+
+#define KEYED_QUEUE_PROBE2(name, a, b)                                         \
+  __asm__ __volatile__(KEYED_QUEUE_SDT_NOTE(name, "8@%0 8@%1")                 \
+                       :: "nor"(keyed_queue_probe_arg(a)),                     \
+                          "nor"(keyed_queue_probe_arg(b)))
+
+#define KEYED_QUEUE_PROBE3(name, a, b, c)                                      \
+  __asm__ __volatile__(KEYED_QUEUE_SDT_NOTE(name, "8@%0 8@%1 8@%2")            \
+                       :: "nor"(keyed_queue_probe_arg(a)),                     \
+                          "nor"(keyed_queue_probe_arg(b)),                     \
+                          "nor"(keyed_queue_probe_arg(c)))
+
+#else
+
+#define KEYED_QUEUE_PROBE1(name, a) ((void) 0)
+#define KEYED_QUEUE_PROBE2(name, a, b) ((void) 0)
+#define KEYED_QUEUE_PROBE3(name, a, b, c) ((void) 0)
+
+#endif
+
+#endif /* KEYED_QUEUE_PROBES_H */
@@ -0,0 +1,251 @@
+#ifndef KEYED_QUEUE_SNAPSHOT_H
+#define KEYED_QUEUE_SNAPSHOT_H
+
+#include "keyed_queue.h"
+
+#include <string>
+#include <cstdio>
+#include <istream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <utility>
+#include <type_traits>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Snapshots of a keyed_queue on disk, written either in place or from a
+// forked child (as Redis' BGSAVE does): the child serialises its
+// copy-on-write image of the process memory while the parent goes on
+// mutating its queue, so the serving thread pays for the fork and for the
+// page faults of pages it writes during the save, never for a copy.
+//
+// File layout: the 8 byte magic "KQSNAP01", the element count as a 64-bit
+// integer, then each element's key and value from front to back, encoded
+// by snapshot_codec. Trivially copyable types are stored as raw bytes and
+// strings as their length and characters; other types need a
+// specialisation.
+//
+// The child of a multithreaded process must not need locks other threads
+// could have held at the fork; the save only allocates its write buffer
+// and whatever the codecs allocate.
+template <class T, class Enable = void>
+struct snapshot_codec;
+
+template <class T>
+struct snapshot_codec<T, std::enable_if_t<std::is_trivially_copyable<T>::value>> {
+  static void write(std::string &out, T const &t) {
+    out.append(reinterpret_cast<char const *>(&t), sizeof(T));
+  }
+
+  static bool read(std::istream &in, T &t) {
+    return bool(in.read(reinterpret_cast<char *>(&t), sizeof(T)));
+  }
+};
+
+template <class C, class Traits, class A>
+struct snapshot_codec<std::basic_string<C, Traits, A>> {
+  static void write(std::string &out, std::basic_string<C, Traits, A> const &s) {
+    uint64_t size = s.size();
+    out.append(reinterpret_cast<char const *>(&size), sizeof(size));
+    out.append(reinterpret_cast<char const *>(s.data()), s.size() * sizeof(C));
+  }
+
+  static bool read(std::istream &in, std::basic_string<C, Traits, A> &s) {
+    uint64_t size;
+    if (!in.read(reinterpret_cast<char *>(&size), sizeof(size)))
+      return false;
+    // The size comes from the file, so the string only grows as far as
+    // characters actually arrive, a chunk at a time.
+    size_t const chunk = (size_t(1) << 16) / sizeof(C);
+    s.clear();
+    while (s.size() < size) {
+      size_t at = s.size();
+      s.resize(at + size_t(std::min<uint64_t>(size - at, chunk)));
+      if (!in.read(reinterpret_cast<char *>(&s[at]), (s.size() - at) * sizeof(C)))
+        return false;
+    }
+    return true;
+  }
+};
+
+namespace snapshot {
+
+char const magic[8] = {'K', 'Q', 'S', 'N', 'A', 'P', '0', '1'};
+
+// Buffered writes to a file descriptor with plain write(2).
+class file_writer {
+private:
+  int fd;
+  bool ok;
+  std::string buffer;
+
+public:
+  explicit file_writer(int f) : fd(f), ok(f >= 0) {
+    buffer.reserve(1 << 20);
+  }
+
+  std::string &out() noexcept {
+    return buffer;
+  }
+
+  bool flush() {
+    size_t done = 0;
+    while (ok && done < buffer.size()) {
+      ssize_t n = ::write(fd, buffer.data() + done, buffer.size() - done);
+      if (n < 0 && errno != EINTR)
+        ok = false;
+      else if (n > 0)
+        done += size_t(n);
+    }
+    buffer.clear();
+    return ok;
+  }
+
+  bool maybe_flush() {
+    return buffer.size() < (1 << 20) || flush();
+  }
+};
+
+// Syncs the directory holding path, which makes a rename into it durable.
+inline bool sync_directory(std::string const &path) {
+  auto slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  bool ok = ::fsync(fd) == 0;
+  return ::close(fd) == 0 && ok;
+}
+
+} // namespace snapshot
+
+// Writes q to path.tmp, syncs it, renames it over path and syncs the
+// directory, so path always holds a complete snapshot and a successful
+// save survives a crash.
+template <class K, class V, class Alloc>
+bool save_snapshot(keyed_queue<K, V, Alloc> const &q, std::string const &path) {
+  std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+
+  snapshot::file_writer writer(fd);
+  uint64_t size = q.size();
+  writer.out().append(snapshot::magic, sizeof(snapshot::magic));
+  writer.out().append(reinterpret_cast<char const *>(&size), sizeof(size));
+  bool ok = true;
+  q.for_each([&](K const &k, V const &v) {
+    snapshot_codec<K>::write(writer.out(), k);
+    snapshot_codec<V>::write(writer.out(), v);
+    ok = ok && writer.maybe_flush();
+  });
+  ok = ok && writer.flush() && ::fsync(fd) == 0;
+  ok = ::close(fd) == 0 && ok;
+  if (ok)
+    ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    ::unlink(tmp.c_str());
+    return false;
+  }
+  return snapshot::sync_directory(path);
+}
+
+// Replaces q with the snapshot at path; q is unchanged if the file is
+// missing or malformed.
+template <class K, class V, class Alloc>
+bool load_snapshot(keyed_queue<K, V, Alloc> &q, std::string const &path) {
+  std::ifstream in(path, std::ios::binary);
+  char header[sizeof(snapshot::magic)];
+  uint64_t size;
+  if (!in.read(header, sizeof(header)) ||
+      !std::equal(header, header + sizeof(header), snapshot::magic) ||
+      !in.read(reinterpret_cast<char *>(&size), sizeof(size)))
+    return false;
+
+  keyed_queue<K, V, Alloc> loaded(q.get_allocator());
+  K k;
+  V v;
+  for (uint64_t i = 0; i < size; ++i) {
+    if (!snapshot_codec<K>::read(in, k) || !snapshot_codec<V>::read(in, v))
+      return false;
+    loaded.push(k, v);
+  }
+  q = std::move(loaded);
+  return true;
+}
+
+// Completion handle of a background_save. The destructor waits for the
+// child if nobody did.
+class background_save_handle {
+private:
+  pid_t pid;
+  int status;
+
+  bool reap(int options) {
+    if (pid <= 0)
+      return true;
+    int s;
+    pid_t r;
+    do
+      r = ::waitpid(pid, &s, options);
+    while (r < 0 && errno == EINTR);
+    if (r == 0)
+      return false;
+    status = r == pid && WIFEXITED(s) ? WEXITSTATUS(s) : 1;
+    pid = 0;
+    return true;
+  }
+
+public:
+  explicit background_save_handle(pid_t p = 0) : pid(p), status(p > 0 ? -1 : 1) {
+  }
+
+  background_save_handle(background_save_handle const &) = delete;
+  background_save_handle &operator=(background_save_handle const &) = delete;
+
+  background_save_handle(background_save_handle &&h) noexcept : pid(h.pid), status(h.status) {
+    h.pid = 0;
+  }
+
+  ~background_save_handle() {
+    reap(0);
+  }
+
+  // Whether the child has exited, without blocking.
+  bool done() {
+    return reap(WNOHANG);
+  }
+
+  // Blocks until the child exits; true if the snapshot was written.
+  bool wait() {
+    reap(0);
+    return status == 0;
+  }
+};
+
+// Forks; the child saves its image of q to path and exits. Throws
+// std::system_error if the fork fails.
+template <class K, class V, class Alloc>
+background_save_handle background_save(keyed_queue<K, V, Alloc> const &q, std::string const &path) {
+  pid_t pid = ::fork();
+  if (pid < 0)
+    throw std::system_error(errno, std::generic_category(), "fork");
+  if (pid == 0) {
+    bool ok = false;
+    try {
+      ok = save_snapshot(q, path);
+    }
+    catch (...) {
+    }
+    ::_exit(ok ? 0 : 1);
+  }
+  return background_save_handle(pid);
+}
+
+#endif /* KEYED_QUEUE_SNAPSHOT_H */
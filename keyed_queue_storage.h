@@ -0,0 +1,347 @@
+#ifndef KEYED_QUEUE_STORAGE_H
+#define KEYED_QUEUE_STORAGE_H
+
+#include <new>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+#include "keyed_queue_trace_events.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Placement of the memory backing a keyed_queue. Every option degrades
+// silently: a kernel without huge pages or NUMA support still gets a
+// working arena made of ordinary pages.
+struct storage_options {
+  enum class numa_policy { none, bind, interleave };
+
+  bool huge_pages = false;
+  numa_policy numa = numa_policy::none;
+  unsigned long node_mask = 0;
+  size_t chunk_size = size_t(2) << 20;
+
+  static storage_options huge() {
+    storage_options o;
+    o.huge_pages = true;
+    return o;
+  }
+
+  static storage_options bound_to(unsigned node, bool huge = false) {
+    storage_options o;
+    o.huge_pages = huge;
+    o.numa = numa_policy::bind;
+    o.node_mask = 1ul << node;
+    return o;
+  }
+
+  static storage_options interleaved(unsigned long mask, bool huge = false) {
+    storage_options o;
+    o.huge_pages = huge;
+    o.numa = numa_policy::interleave;
+    o.node_mask = mask;
+    return o;
+  }
+};
+
+// Bitmask of the online NUMA nodes, or just node 0 where that is unknown.
+inline unsigned long online_numa_nodes() {
+  std::ifstream in("/sys/devices/system/node/online");
+  std::string list;
+  unsigned long mask = 0;
+  if (!(in >> list))
+    return 1;
+
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    std::string range = list.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    size_t dash = range.find('-');
+    unsigned long lo = std::stoul(range.substr(0, dash));
+    unsigned long hi = dash == std::string::npos ? lo : std::stoul(range.substr(dash + 1));
+    for (unsigned long n = lo; n <= hi && n < sizeof(mask) * 8; ++n)
+      mask |= 1ul << n;
+    if (end == std::string::npos)
+      break;
+    pos = end + 1;
+  }
+  return mask != 0 ? mask : 1;
+}
+
+// Chunked arena with size-class free lists. List and map nodes of a queue
+// are small and equally sized, so after warm-up every allocation is served
+// from a free list and the chunks stay densely packed on 2MB pages.
+//
+// Blocks up to 512 bytes come in 16 byte steps, larger ones in four classes
+// per power of two; both are carved from the shared chunks. Only blocks
+// whose class would exceed a chunk get a region of their own, which is
+// unmapped when they are freed.
+class storage_arena {
+private:
+  static const size_t granule = 16;
+  static const size_t max_small = 512;
+  static const size_t small_classes = max_small / granule;
+  static const size_t classes = small_classes + 4 * (sizeof(size_t) * 8 - 9);
+  static const size_t page = 4096;
+  static const size_t huge_page = size_t(2) << 20;
+  static const size_t no_class = size_t(-1);
+
+  struct free_node {
+    free_node *next;
+  };
+
+  std::mutex mutex;
+  storage_options options;
+  std::vector<std::pair<void *, size_t>> chunks;
+  char *cursor;
+  char *limit;
+  free_node *free_lists[classes];
+
+  static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+  }
+
+  static size_t low_bit(size_t n) {
+    return n & (~n + 1);
+  }
+
+  // Alignment of every block of a class of the given size.
+  static size_t class_align(size_t size) {
+    if (size <= max_small)
+      return granule;
+    return low_bit(size) < page ? low_bit(size) : page;
+  }
+
+  // The class serving bytes at align, and its block size; no_class if the
+  // block needs a region of its own.
+  size_t size_class(size_t bytes, size_t align, size_t &size) const;
+
+  void *map_region(size_t bytes);
+  void unmap_region(void *p, size_t bytes) noexcept;
+
+public:
+  explicit storage_arena(storage_options const &o = storage_options())
+      : options(o), cursor(nullptr), limit(nullptr) {
+    if (options.chunk_size < huge_page)
+      options.chunk_size = huge_page;
+    options.chunk_size = round_up(options.chunk_size, huge_page);
+    for (size_t i = 0; i < classes; ++i)
+      free_lists[i] = nullptr;
+  }
+
+  storage_arena(storage_arena const &) = delete;
+  storage_arena &operator=(storage_arena const &) = delete;
+
+  ~storage_arena() {
+    for (auto const &chunk : chunks)
+      unmap_region(chunk.first, chunk.second);
+  }
+
+  storage_options const &get_options() const noexcept {
+    return options;
+  }
+
+  void *allocate(size_t bytes, size_t align);
+  void deallocate(void *p, size_t bytes, size_t align) noexcept;
+};
+
+inline void *storage_arena::map_region(size_t bytes) {
+  KEYED_QUEUE_TRACE_SCOPE("arena map");
+#ifdef __linux__
+  void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (options.huge_pages)
+    p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+  if (p == MAP_FAILED) {
+    // Over-map so the region can be trimmed to a 2MB boundary, otherwise
+    // transparent huge pages can never back its first and last pages.
+    size_t padded = bytes + huge_page;
+    char *raw = static_cast<char *>(mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (raw == MAP_FAILED)
+      throw std::bad_alloc();
+
+    char *aligned = reinterpret_cast<char *>(
+        round_up(reinterpret_cast<size_t>(raw), huge_page));
+    if (aligned != raw)
+      munmap(raw, aligned - raw);
+    if (raw + padded != aligned + bytes)
+      munmap(aligned + bytes, (raw + padded) - (aligned + bytes));
+    p = aligned;
+
+#ifdef MADV_HUGEPAGE
+    if (options.huge_pages)
+      madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+  }
+
+#ifdef SYS_mbind
+  // MPOL_BIND and MPOL_INTERLEAVE from <linux/mempolicy.h>; the policy has to
+  // be in place before the first touch, and failure leaves the default.
+  if (options.numa != storage_options::numa_policy::none && options.node_mask != 0) {
+    int mode = options.numa == storage_options::numa_policy::bind ? 2 : 3;
+    unsigned long mask = options.node_mask;
+    syscall(SYS_mbind, p, bytes, mode, &mask, sizeof(mask) * 8, 0);
+  }
+#endif
+
+  return p;
+#else
+  return ::operator new(bytes, std::align_val_t(huge_page));
+#endif
+}
+
+inline void storage_arena::unmap_region(void *p, size_t bytes) noexcept {
+#ifdef __linux__
+  munmap(p, bytes);
+#else
+  (void) bytes;
+  ::operator delete(p, std::align_val_t(huge_page));
+#endif
+}
+
+inline size_t storage_arena::size_class(size_t bytes, size_t align, size_t &size) const {
+  if (align <= granule && bytes <= max_small) {
+    size = round_up(bytes, granule);
+    return size / granule - 1;
+  }
+
+  // Over-aligned blocks move up to the first class aligned enough.
+  if (align > page || bytes > options.chunk_size)
+    return no_class;
+  if (bytes <= max_small)
+    bytes = max_small + 1;
+  for (;;) {
+    size_t log = 0;
+    while ((size_t(2) << log) < bytes)
+      ++log;
+    size_t step = size_t(1) << (log - 2);
+    size = round_up(bytes, step);
+    if (size > options.chunk_size)
+      return no_class;
+    if (class_align(size) >= align)
+      return small_classes + (log - 9) * 4 + (size / step - 5);
+    bytes = size + 1;
+  }
+}
+
+inline void *storage_arena::allocate(size_t bytes, size_t align) {
+  if (bytes == 0)
+    bytes = 1;
+
+  size_t size;
+  size_t cls = size_class(bytes, align, size);
+  if (cls == no_class) {
+    if (align > huge_page)
+      throw std::bad_alloc();
+    return map_region(round_up(bytes, huge_page));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (free_lists[cls] != nullptr) {
+    free_node *node = free_lists[cls];
+    free_lists[cls] = node->next;
+    return node;
+  }
+
+  char *at = cursor == nullptr ? nullptr : reinterpret_cast<char *>(
+      round_up(reinterpret_cast<size_t>(cursor), class_align(size)));
+  if (at == nullptr || at > limit || size_t(limit - at) < size) {
+    chunks.reserve(chunks.size() + 1);
+    char *chunk = static_cast<char *>(map_region(options.chunk_size));
+    chunks.emplace_back(chunk, options.chunk_size);
+    at = chunk;
+    limit = chunk + options.chunk_size;
+  }
+
+  cursor = at + size;
+  return at;
+}
+
+inline void storage_arena::deallocate(void *p, size_t bytes, size_t align) noexcept {
+  if (p == nullptr)
+    return;
+  if (bytes == 0)
+    bytes = 1;
+
+  size_t size;
+  size_t cls = size_class(bytes, align, size);
+  if (cls == no_class) {
+    unmap_region(p, round_up(bytes, huge_page));
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  free_node *node = static_cast<free_node *>(p);
+  node->next = free_lists[cls];
+  free_lists[cls] = node;
+}
+
+// Stateful allocator handing out memory from a shared storage_arena. Copies
+// of a queue built with it allocate from the same arena, so clones made by
+// copy-on-write keep the placement of the original.
+template <class T>
+class arena_allocator {
+  template <class U> friend class arena_allocator;
+
+private:
+  std::shared_ptr<storage_arena> arena;
+
+public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  explicit arena_allocator(storage_options const &o = storage_options())
+      : arena(std::make_shared<storage_arena>(o)) {
+  }
+
+  explicit arena_allocator(std::shared_ptr<storage_arena> a) noexcept
+      : arena(std::move(a)) {
+  }
+
+  template <class U>
+  arena_allocator(arena_allocator<U> const &a) noexcept : arena(a.arena) {
+  }
+
+  T *allocate(size_t n) {
+    KEYED_QUEUE_TRACE_SCOPE("arena allocate");
+    return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *p, size_t n) noexcept {
+    KEYED_QUEUE_TRACE_SCOPE("arena deallocate");
+    arena->deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  std::shared_ptr<storage_arena> const &get_arena() const noexcept {
+    return arena;
+  }
+
+  template <class U>
+  bool operator==(arena_allocator<U> const &a) const noexcept {
+    return arena == a.arena;
+  }
+
+  template <class U>
+  bool operator!=(arena_allocator<U> const &a) const noexcept {
+    return arena != a.arena;
+  }
+};
+
+#endif /* KEYED_QUEUE_STORAGE_H */
@@ -0,0 +1,243 @@
+#ifndef KEYED_QUEUE_TRACE_EVENTS_H
+#define KEYED_QUEUE_TRACE_EVENTS_H
+
+// Timed trace events for the internal phases of keyed_queue (clone phases,
+// move_to_back splices, arena allocation), enabled by defining
+// KEYED_QUEUE_TRACE_EVENTS; otherwise KEYED_QUEUE_TRACE_SCOPE expands to
+// nothing. Each thread appends to a buffer of its own without locking, and
+// trace_events::write_chrome_json() drains everything recorded since its
+// last call into the Chrome trace-event format, which the Perfetto UI and
+// chrome://tracing open offline.
+
+#ifdef KEYED_QUEUE_TRACE_EVENTS
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <unistd.h>
+
+namespace trace_events {
+
+struct event {
+  char const *name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+};
+
+// A ring written only by its thread and drained by write_chrome_json():
+// events between consumed and published are pending, and an event that
+// finds the ring full of pending events is counted and dropped.
+struct thread_buffer {
+  static const size_t capacity = 1 << 16;
+
+  event events[capacity];
+  std::atomic<size_t> published;
+  std::atomic<size_t> consumed;
+  std::atomic<size_t> dropped;
+  // Set under the registry's lock: the track the events go on, and
+  // whether the thread that wrote them has exited.
+  uint32_t tid;
+  bool retired;
+
+  explicit thread_buffer(uint32_t t) : published(0), consumed(0), dropped(0), tid(t), retired(false) {
+  }
+
+  size_t pending() const noexcept {
+    return published.load(std::memory_order_acquire) - consumed.load(std::memory_order_relaxed);
+  }
+
+  void append(event const &e) noexcept {
+    size_t n = published.load(std::memory_order_relaxed);
+    if (n - consumed.load(std::memory_order_acquire) == capacity) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    events[n % capacity] = e;
+    published.store(n + 1, std::memory_order_release);
+  }
+
+  // Calls f for every pending event, oldest first, then frees their slots.
+  // Returns and resets the number dropped since the last drain.
+  template <class F>
+  size_t drain(F f) {
+    size_t from = consumed.load(std::memory_order_relaxed);
+    size_t to = published.load(std::memory_order_acquire);
+    for (size_t i = from; i != to; ++i)
+      f(events[i % capacity]);
+    consumed.store(to, std::memory_order_release);
+    return dropped.exchange(0, std::memory_order_relaxed);
+  }
+};
+
+// Buffers outlive their threads, so events of finished threads are written
+// too, and are then handed to new threads: a buffer once drained, or, when
+// more than max_retired undrained ones have piled up, the oldest of those,
+// whose events count as dropped. Buffers thus stay bounded by the threads
+// alive at once plus max_retired. The mutex is only taken when a thread
+// records its first event and when it exits.
+class registry {
+private:
+  static const size_t max_retired = 8;
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<thread_buffer>> buffers;
+  uint32_t next_tid = 1;
+
+public:
+  static registry &get() {
+    static registry r;
+    return r;
+  }
+
+  thread_buffer *acquire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    thread_buffer *reuse = nullptr;
+    size_t retired = 0;
+    for (auto const &b : buffers)
+      if (b->retired) {
+        if (b->pending() == 0) {
+          reuse = b.get();
+          break;
+        }
+        if (reuse == nullptr)
+          reuse = b.get();
+        ++retired;
+      }
+
+    if (reuse != nullptr && (reuse->pending() == 0 || retired > max_retired)) {
+      size_t lost = reuse->pending();
+      reuse->consumed.store(reuse->published.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      reuse->dropped.fetch_add(lost, std::memory_order_relaxed);
+      reuse->retired = false;
+      reuse->tid = next_tid++;
+      return reuse;
+    }
+
+    buffers.reserve(buffers.size() + 1);
+    buffers.emplace_back(new thread_buffer(next_tid));
+    ++next_tid;
+    return buffers.back().get();
+  }
+
+  void release(thread_buffer *b) {
+    std::lock_guard<std::mutex> lock(mutex);
+    b->retired = true;
+  }
+
+  template <class F>
+  void for_each(F f) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto const &b : buffers)
+      f(*b);
+  }
+};
+
+inline uint64_t now_ns() noexcept {
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// The calling thread's buffer, handed back to the registry when it exits.
+class buffer_owner {
+private:
+  thread_buffer *buffer;
+
+public:
+  buffer_owner() : buffer(registry::get().acquire()) {
+  }
+
+  buffer_owner(buffer_owner const &) = delete;
+  buffer_owner &operator=(buffer_owner const &) = delete;
+
+  ~buffer_owner() {
+    try {
+      registry::get().release(buffer);
+    }
+    catch (...) {
+    }
+  }
+
+  thread_buffer &get() const noexcept {
+    return *buffer;
+  }
+};
+
+inline thread_buffer &local_buffer() {
+  static thread_local buffer_owner owner;
+  return owner.get();
+}
+
+// Records the time from construction to destruction as one event; name
+// must be a string literal.
+class scope {
+private:
+  char const *name;
+  uint64_t start;
+
+public:
+  explicit scope(char const *n) noexcept : name(n), start(now_ns()) {
+  }
+
+  scope(scope const &) = delete;
+  scope &operator=(scope const &) = delete;
+
+  // A thread's first event allocates its buffer; if that fails the event
+  // is lost rather than thrown from a destructor.
+  ~scope() {
+    uint64_t end = now_ns();
+    try {
+      local_buffer().append(event{name, start, end - start});
+    }
+    catch (...) {
+    }
+  }
+};
+
+// Complete ("X") events with microsecond timestamps, one track per thread.
+// Writes the events recorded since the previous call and frees their room
+// in the buffers, so a long run can be traced in consecutive files; the
+// events dropped in between are reported as otherData.dropped. Returns
+// false if the file cannot be opened, in which case nothing is drained.
+// Concurrent calls are serialised by the registry's lock, so every event
+// goes to exactly one file, but a single consumer calling it periodically
+// is what keeps the files in time order.
+inline bool write_chrome_json(char const *path) {
+  FILE *out = std::fopen(path, "w");
+  if (out == nullptr)
+    return false;
+
+  long pid = long(getpid());
+  bool first = true;
+  size_t dropped = 0;
+  std::fprintf(out, "{\"traceEvents\":[\n");
+  registry::get().for_each([&](thread_buffer &b) {
+    dropped += b.drain([&](event const &e) {
+      std::fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"keyed_queue\",\"ph\":\"X\","
+                        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%u}",
+                   first ? "" : ",\n", e.name, e.start_ns / 1e3, e.duration_ns / 1e3, pid, b.tid);
+      first = false;
+    });
+  });
+  std::fprintf(out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%zu}}\n", dropped);
+  return std::fclose(out) == 0;
+}
+
+} // namespace trace_events
+
+#define KEYED_QUEUE_TRACE_CONCAT2(a, b) a##b
+#define KEYED_QUEUE_TRACE_CONCAT(a, b) KEYED_QUEUE_TRACE_CONCAT2(a, b)
+#define KEYED_QUEUE_TRACE_SCOPE(name) \
+  trace_events::scope KEYED_QUEUE_TRACE_CONCAT(keyed_queue_trace_scope_, __LINE__)(name)
+
+#else
+
+#define KEYED_QUEUE_TRACE_SCOPE(name) ((void) 0)
+
+#endif
+
+#endif /* KEYED_QUEUE_TRACE_EVENTS_H */
@@ -0,0 +1,346 @@
+#ifndef KEYED_QUEUE_VISIBILITY_H
+#define KEYED_QUEUE_VISIBILITY_H
+
+#include "keyed_queue.h"
+
+#include <map>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+
+// Per entry: its place in its key's list, its place in queue order, a
+// number that only grows towards the back, and the ticket it is hidden
+// under, 0 while visible.
+template <class QueueIt, class KeysIt>
+struct keyed_queue_visibility_extra {
+  KeysIt position;
+  uint64_t seq;
+  uint64_t ticket;
+};
+
+// Representation of a keyed_queue whose entries can be hidden in place
+// under a ticket and revealed again, for the queues that hold entries back
+// (scheduled_keyed_queue, lease_keyed_queue). Hidden entries keep their
+// place in the queue and count in size(), count(k) and the keys, but
+// front(), back(), pop, the first(k) family and for_each only see the
+// visible ones, which are ordered by their place in the queue both in all
+// and per key.
+//
+// front(), back(), first(k) and last(k) are O(1) past the key lookup;
+// hiding, revealing and popping are O(log n). A hidden entry keeps the
+// nodes it takes up in the visible orders, so revealing never allocates
+// and cannot fail.
+template <class K, class V, class Alloc>
+class keyed_queue_visibility : public keyed_queue_base<K, V, Alloc, keyed_queue_visibility_extra> {
+private:
+  using base = keyed_queue_base<K, V, Alloc, keyed_queue_visibility_extra>;
+  using typename base::CKey_Value;
+  using typename base::CKey_CValue;
+  using typename base::iterator;
+  using order_t = std::map<uint64_t, iterator, std::less<uint64_t>,
+                           typename base::template rebind_alloc<std::pair<const uint64_t, iterator>>>;
+  using order_node = typename order_t::node_type;
+
+  // A key's visible entries, and how many entries it has in all; kept
+  // while it has any, so that revealing one finds it.
+  struct key_order {
+    order_t visible;
+    size_t entries;
+  };
+
+  // A hidden entry and the nodes it takes up once visible again.
+  struct hidden_entry_t {
+    iterator it;
+    order_node in_queue;
+    order_node in_key;
+  };
+
+  using key_orders_t = std::unordered_map<K const *, key_order, std::hash<K const *>, std::equal_to<K const *>,
+                                          typename base::template rebind_alloc<std::pair<K const *const, key_order>>>;
+  using tickets_t = std::unordered_map<uint64_t, hidden_entry_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                                       typename base::template rebind_alloc<std::pair<const uint64_t, hidden_entry_t>>>;
+
+  order_t visible;
+  key_orders_t key_orders;
+  tickets_t tickets;
+  uint64_t next_seq;
+
+  order_node make_node() {
+    order_t one(visible.get_allocator());
+    return one.extract(one.emplace(0, iterator()).first);
+  }
+
+  key_order &order_of(iterator it) noexcept {
+    return key_orders.find(it->first)->second;
+  }
+
+  // Pushes k, v at the back, in no visible order yet.
+  iterator push_entry(K const &k, V const &v, uint64_t ticket) {
+    auto pushed = base::push(k, v);
+    auto it = pushed.first;
+    it->position = pushed.second;
+    it->ticket = ticket;
+    try {
+      ++key_orders.emplace(it->first, key_order{order_t(visible.get_allocator()), 0}).first->second.entries;
+    }
+    catch (...) {
+      base::erase(it, it->position);
+      throw;
+    }
+    it->seq = ++next_seq;
+    return it;
+  }
+
+  void show(iterator it, order_node in_queue, order_node in_key) noexcept {
+    in_queue.key() = in_key.key() = it->seq;
+    in_queue.mapped() = in_key.mapped() = it;
+    visible.insert(visible.end(), std::move(in_queue));
+    order_t &order = order_of(it).visible;
+    order.insert(order.end(), std::move(in_key));
+  }
+
+  // Drops it from the visible orders or the tickets, and its key's order
+  // with its last entry; the base still holds it.
+  void forget(iterator it) noexcept {
+    auto order = key_orders.find(it->first);
+    if (it->ticket != 0)
+      tickets.erase(it->ticket);
+    else {
+      visible.erase(it->seq);
+      order->second.visible.erase(it->seq);
+    }
+    if (--order->second.entries == 0)
+      key_orders.erase(order);
+  }
+
+  void remove(iterator it) {
+    forget(it);
+    base::erase(it, it->position);
+  }
+
+  // The visible entry nearest the front or the back of k's entries,
+  // failing if k has none.
+  iterator visible_end(K const &k, bool last) const {
+    auto nodes_it = this->find(k);
+    this->check_nodes_iterator(nodes_it);
+    auto const &order = key_orders.find(nodes_it->second.front()->first)->second.visible;
+    if (order.empty())
+      this->fail();
+    return last ? order.rbegin()->second : order.begin()->second;
+  }
+
+public:
+  explicit keyed_queue_visibility(Alloc const &a) : base(a), visible(a), key_orders(a), tickets(a), next_seq(0) {
+  }
+
+  keyed_queue_visibility(keyed_queue_visibility const &b)
+      : base(b), visible(b.get_allocator()), key_orders(b.get_allocator()), tickets(b.get_allocator()),
+        next_seq(b.next_seq) {
+    KEYED_QUEUE_VISIT(this->queue.size());
+    key_orders.reserve(this->nodes.size());
+    for (auto nodes_it = this->nodes.begin(); nodes_it != this->nodes.end(); ++nodes_it) {
+      for (auto pos = nodes_it->second.begin(); pos != nodes_it->second.end(); ++pos)
+        (*pos)->position = pos;
+      key_orders.emplace(nodes_it->second.front()->first,
+                         key_order{order_t(visible.get_allocator()), nodes_it->second.size()});
+    }
+    tickets.reserve(b.tickets.size());
+    for (auto it = this->queue.begin(); it != this->queue.end(); ++it)
+      if (it->ticket == 0) {
+        visible.emplace_hint(visible.end(), it->seq, it);
+        order_t &order = order_of(it).visible;
+        order.emplace_hint(order.end(), it->seq, it);
+      }
+      else
+        tickets.emplace(it->ticket, hidden_entry_t{it, make_node(), make_node()});
+  }
+
+  void check_visible() const {
+    if (visible.empty())
+      this->fail();
+  }
+
+  void check_visible(K const &k) const {
+    visible_end(k, false);
+  }
+
+  bool has_ticket(uint64_t ticket) const {
+    return tickets.find(ticket) != tickets.end();
+  }
+
+  void check_ticket(uint64_t ticket) const {
+    if (!has_ticket(ticket))
+      this->fail();
+  }
+
+  void push(K const &k, V const &v) {
+    order_node in_queue = make_node();
+    order_node in_key = make_node();
+    show(push_entry(k, v, 0), std::move(in_queue), std::move(in_key));
+  }
+
+  // Pushes k, v hidden under ticket, which must be new and not 0.
+  void push_hidden(K const &k, V const &v, uint64_t ticket) {
+    auto counted = tickets.emplace(ticket, hidden_entry_t{iterator(), make_node(), make_node()}).first;
+    try {
+      counted->second.it = push_entry(k, v, ticket);
+    }
+    catch (...) {
+      tickets.erase(counted);
+      throw;
+    }
+  }
+
+  // Hides the front visible entry under ticket.
+  void hide_front(uint64_t ticket) {
+    iterator it = visible.begin()->second;
+    auto &hidden = tickets.emplace(ticket, hidden_entry_t{it, order_node(), order_node()}).first->second;
+    hidden.in_queue = visible.extract(visible.begin());
+    hidden.in_key = order_of(it).visible.extract(it->seq);
+    it->ticket = ticket;
+  }
+
+  // Makes the entry hidden under ticket visible again at its place, and
+  // returns false if there is none.
+  bool reveal(uint64_t ticket) noexcept {
+    auto found = tickets.find(ticket);
+    if (found == tickets.end())
+      return false;
+    iterator it = found->second.it;
+    order_node in_queue = std::move(found->second.in_queue);
+    order_node in_key = std::move(found->second.in_key);
+    tickets.erase(found);
+    it->ticket = 0;
+    show(it, std::move(in_queue), std::move(in_key));
+    return true;
+  }
+
+  // Removes the entry hidden under ticket.
+  void erase_hidden(uint64_t ticket) {
+    remove(tickets.find(ticket)->second.it);
+  }
+
+  CKey_Value hidden_entry(uint64_t ticket) {
+    auto it = tickets.find(ticket)->second.it;
+    return CKey_Value(*(it->first), it->second);
+  }
+
+  CKey_CValue hidden_entry(uint64_t ticket) const {
+    auto it = tickets.find(ticket)->second.it;
+    return CKey_CValue(*(it->first), it->second);
+  }
+
+  void pop() {
+    remove(visible.rbegin()->second);
+  }
+
+  void pop(K const &k) {
+    remove(visible_end(k, true));
+  }
+
+  // The entries of k move to the back of the queue, and the visible ones
+  // to the back of the visible order, both in their order.
+  void move_to_back(K const &k) {
+    base::move_to_back(k);
+    auto const &entries = this->find(k)->second;
+    order_t &order = order_of(entries.front()).visible;
+    for (auto it : entries) {
+      if (it->ticket != 0) {
+        it->seq = ++next_seq;
+        continue;
+      }
+      order_node in_queue = visible.extract(it->seq);
+      order_node in_key = order.extract(it->seq);
+      it->seq = ++next_seq;
+      show(it, std::move(in_queue), std::move(in_key));
+    }
+  }
+
+  // Hidden entries of k go too, with their tickets.
+  size_t pop_all(K const &k) {
+    auto nodes_it = this->find(k);
+    this->check_nodes_iterator(nodes_it);
+    for (auto it : nodes_it->second)
+      forget(it);
+    return base::pop_all(k);
+  }
+
+  // Positions count hidden entries too.
+  void erase_positions(std::vector<size_t> const &positions) noexcept {
+    auto next = positions.begin();
+    size_t position = 0;
+    for (auto it = this->queue.begin(); next != positions.end(); ++it, ++position)
+      if (position == *next) {
+        forget(it);
+        ++next;
+      }
+    base::erase_positions(positions);
+  }
+
+  CKey_Value front() {
+    auto it = visible.begin()->second;
+    return CKey_Value(*(it->first), it->second);
+  }
+
+  CKey_Value back() {
+    auto it = visible.rbegin()->second;
+    return CKey_Value(*(it->first), it->second);
+  }
+
+  CKey_CValue front() const {
+    auto it = visible.begin()->second;
+    return CKey_CValue(*(it->first), it->second);
+  }
+
+  CKey_CValue back() const {
+    auto it = visible.rbegin()->second;
+    return CKey_CValue(*(it->first), it->second);
+  }
+
+  CKey_Value first(K const &k) {
+    auto it = visible_end(k, false);
+    return CKey_Value(*(it->first), it->second);
+  }
+
+  CKey_Value last(K const &k) {
+    auto it = visible_end(k, true);
+    return CKey_Value(*(it->first), it->second);
+  }
+
+  CKey_CValue first(K const &k) const {
+    auto it = visible_end(k, false);
+    return CKey_CValue(*(it->first), it->second);
+  }
+
+  CKey_CValue last(K const &k) const {
+    auto it = visible_end(k, true);
+    return CKey_CValue(*(it->first), it->second);
+  }
+
+  size_t visible_size() const noexcept {
+    return visible.size();
+  }
+
+  size_t hidden_size() const noexcept {
+    return tickets.size();
+  }
+
+  void clear() noexcept {
+    tickets.clear();
+    key_orders.clear();
+    visible.clear();
+    base::clear();
+  }
+
+  // Visible entries, from front to back.
+  template <class F>
+  void for_each(F &f) const {
+    for (auto const &entry : visible)
+      f(*(entry.second->first), entry.second->second);
+  }
+};
+
+#endif /* KEYED_QUEUE_VISIBILITY_H */
@@ -0,0 +1,263 @@
+#ifndef LEASE_KEYED_QUEUE_H
+#define LEASE_KEYED_QUEUE_H
+
+#include "keyed_queue_visibility.h"
+#include "timing_wheel.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+// keyed_queue for at-least-once consumers. reserve() leases the first
+// visible entry: it stays in place, still counted, but hidden from front(),
+// pop, the first(k) family and further reserves until the lease is
+// acknowledged (the entry is removed), refused with nack() or expires,
+// after which it is visible again at its original position. Values are
+// never moved or copied by leasing.
+//
+// A lease hides its entry under the lease's ticket (keyed_queue_visibility),
+// so reserve and ack are O(1) and nack and expiry usually are. Lease expiry
+// runs on a timing_wheel; the non-const operations first expire whatever
+// is due by Clock::now(). Copies share the entries until one of them
+// changes, and each carries on the leases taken before it was made.
+// Handles of acknowledged, refused or expired leases are stale and make
+// ack(), nack() and leased() throw lookup_error.
+template <class K, class V, class Clock = std::chrono::steady_clock,
+          class Alloc = std::allocator<std::pair<const K, V>>>
+class lease_keyed_queue {
+public:
+  using time_point = typename Clock::time_point;
+  using duration = typename Clock::duration;
+
+  class lease_handle {
+  friend class lease_keyed_queue;
+
+  private:
+    uint64_t id;
+
+  public:
+    lease_handle() : id(0) {
+    }
+  };
+
+private:
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+  using base_queue = keyed_queue_visibility<K, V, Alloc>;
+
+  keyed_queue_cow<base_queue, Alloc> queue_ptr;
+  timing_wheel<uint64_t, Clock> expiries;
+  uint64_t next_lease;
+
+public:
+  using k_iterator = typename base_queue::k_iterator;
+
+  explicit lease_keyed_queue(duration tick = std::chrono::milliseconds(1), size_t slots = 4096,
+                             Alloc const &a = Alloc())
+      : queue_ptr(a), expiries(tick, slots), next_lease(1) {
+  }
+
+  // Makes every lease that expired by now visible again. The queue is only
+  // detached if a lease was still outstanding.
+  void advance(time_point now) {
+    typename keyed_queue_cow<base_queue, Alloc>::pointer ptr;
+    expiries.advance(now, [&](uint64_t id) {
+      if (!ptr) {
+        if (!queue_ptr->has_ticket(id))
+          return;
+        ptr = queue_ptr.writable();
+      }
+      ptr->reveal(id);
+    });
+    if (ptr)
+      queue_ptr.commit(ptr);
+  }
+
+  void advance() {
+    advance(Clock::now());
+  }
+
+  void push(K const &k, V const &v) {
+    queue_ptr.write([&](base_queue &b) {
+      b.push(k, v);
+    });
+  }
+
+  // Leases the first visible entry for the given time; false if every
+  // entry is leased.
+  bool reserve(duration lease, lease_handle &h) {
+    advance();
+    if (queue_ptr->visible_size() == 0)
+      return false;
+
+    // An expiry left in the wheel by a failed reserve finds no lease.
+    uint64_t id = next_lease++;
+    expiries.schedule(id, Clock::now() + lease);
+    queue_ptr.write([id](base_queue &b) {
+      b.hide_front(id);
+    });
+    h.id = id;
+    return true;
+  }
+
+  // Removes the leased entry.
+  void ack(lease_handle const &h) {
+    queue_ptr->check_ticket(h.id);
+    queue_ptr.write([&h](base_queue &b) {
+      b.erase_hidden(h.id);
+    });
+  }
+
+  // Makes the leased entry visible again at its position.
+  void nack(lease_handle const &h) {
+    queue_ptr->check_ticket(h.id);
+    queue_ptr.write([&h](base_queue &b) {
+      b.reveal(h.id);
+    });
+  }
+
+  CKey_Value leased(lease_handle const &h) {
+    queue_ptr->check_ticket(h.id);
+    return queue_ptr.mutate().hidden_entry(h.id);
+  }
+
+  CKey_CValue leased(lease_handle const &h) const {
+    queue_ptr->check_ticket(h.id);
+    return queue_ptr->hidden_entry(h.id);
+  }
+
+  // Removes the last visible entry.
+  void pop() {
+    advance();
+    queue_ptr->check_visible();
+    queue_ptr.write([](base_queue &b) {
+      b.pop();
+    });
+  }
+
+  void pop(K const &k) {
+    advance();
+    queue_ptr->check_visible(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.pop(k);
+    });
+  }
+
+  // Moves every entry of k, leased ones too, to the back.
+  void move_to_back(K const &k) {
+    advance();
+    queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.move_to_back(k);
+    });
+  }
+
+  // Removes every entry with key k, ending the leases on them, and returns
+  // how many there were.
+  size_t pop_all(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.write([&](base_queue &b) {
+      return b.pop_all(k);
+    });
+  }
+
+  // Removes every entry for which pred(k, v) holds, ending the leases on
+  // them, and returns how many there were.
+  template <class Pred>
+  size_t erase_if(Pred pred) {
+    auto positions = queue_ptr->match(pred);
+    if (positions.empty())
+      return 0;
+    queue_ptr.write([&](base_queue &b) {
+      b.erase_positions(positions);
+    });
+    return positions.size();
+  }
+
+  // First and last visible entries.
+  CKey_Value front() {
+    advance();
+    queue_ptr->check_visible();
+    return queue_ptr.mutate().front();
+  }
+
+  CKey_Value back() {
+    advance();
+    queue_ptr->check_visible();
+    return queue_ptr.mutate().back();
+  }
+
+  CKey_CValue front() const {
+    queue_ptr->check_visible();
+    return queue_ptr->front();
+  }
+
+  CKey_CValue back() const {
+    queue_ptr->check_visible();
+    return queue_ptr->back();
+  }
+
+  CKey_Value first(K const &k) {
+    advance();
+    queue_ptr->check_visible(k);
+    return queue_ptr.mutate().first(k);
+  }
+
+  CKey_Value last(K const &k) {
+    advance();
+    queue_ptr->check_visible(k);
+    return queue_ptr.mutate().last(k);
+  }
+
+  CKey_CValue first(K const &k) const {
+    return queue_ptr->first(k);
+  }
+
+  CKey_CValue last(K const &k) const {
+    return queue_ptr->last(k);
+  }
+
+  // Visible and leased entries.
+  size_t size() const noexcept {
+    return queue_ptr->size();
+  }
+
+  bool empty() const noexcept {
+    return queue_ptr->empty();
+  }
+
+  size_t count(K const &k) const {
+    return queue_ptr->count(k);
+  }
+
+  size_t leased_size() const noexcept {
+    return queue_ptr->hidden_size();
+  }
+
+  void clear() {
+    queue_ptr.clear();
+    expiries.clear();
+  }
+
+  Alloc get_allocator() const {
+    return queue_ptr->get_allocator();
+  }
+
+  // Calls f(k, v) for every visible entry, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    queue_ptr->for_each(f);
+  }
+
+  // Keys with visible or leased entries.
+  k_iterator k_begin() const noexcept {
+    return queue_ptr->k_begin();
+  }
+
+  k_iterator k_end() const noexcept {
+    return queue_ptr->k_end();
+  }
+};
+
+#endif /* LEASE_KEYED_QUEUE_H */
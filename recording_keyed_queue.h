@@ -0,0 +1,379 @@
+#ifndef RECORDING_KEYED_QUEUE_H
+#define RECORDING_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <utility>
+#include <functional>
+
+// Compact binary trace of keyed_queue operations. Keys are stored as a
+// SipHash-2-4 of their hash under a random secret that each writer draws
+// and never stores, and values only by size, so a trace of production
+// traffic carries its access pattern but none of its data: equal keys hash
+// equally within a trace, but a key cannot be recovered, or matched across
+// traces, without the secret.
+//
+// Reads through a const queue are recorded separately from mutable ones,
+// since only the latter make a shared queue unshareable.
+//
+// File layout: the 8 byte magic "KQTRACE1", then one record per operation:
+// an opcode byte followed by LEB128 varints for the queue id, and where the
+// operation has them, the key hash and the value size (push) or the id of
+// the new queue (copy).
+namespace trace {
+
+enum class op : uint8_t {
+  push = 1,
+  pop = 2,
+  pop_key = 3,
+  move_to_back = 4,
+  front = 5,
+  back = 6,
+  first = 7,
+  last = 8,
+  count = 9,
+  copy = 10,
+  clear = 11,
+  destroy = 12,
+  const_front = 13,
+  const_back = 14,
+  const_first = 15,
+  const_last = 16
+};
+
+struct record {
+  op code;
+  uint64_t queue;
+  uint64_t key;
+  uint64_t value_size;
+  uint64_t target;
+};
+
+inline bool has_key(op code) {
+  return code == op::push || code == op::pop_key || code == op::move_to_back ||
+         code == op::first || code == op::last || code == op::count ||
+         code == op::const_first || code == op::const_last;
+}
+
+char const magic[8] = {'K', 'Q', 'T', 'R', 'A', 'C', 'E', '1'};
+
+inline uint64_t rotl(uint64_t x, unsigned b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+inline void sip_round(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3) {
+  v0 += v1;
+  v1 = rotl(v1, 13) ^ v0;
+  v0 = rotl(v0, 32);
+  v2 += v3;
+  v3 = rotl(v3, 16) ^ v2;
+  v0 += v3;
+  v3 = rotl(v3, 21) ^ v0;
+  v2 += v1;
+  v1 = rotl(v1, 17) ^ v2;
+  v2 = rotl(v2, 32);
+}
+
+// SipHash-2-4 under the key (k0, k1) of the 8 bytes of m, little-endian.
+inline uint64_t siphash(uint64_t k0, uint64_t k1, uint64_t m) {
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+  uint64_t v3 = k1 ^ 0x7465646279746573ull;
+  for (uint64_t block : {m, uint64_t(8) << 56}) {
+    v3 ^= block;
+    sip_round(v0, v1, v2, v3);
+    sip_round(v0, v1, v2, v3);
+    v0 ^= block;
+  }
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; ++i)
+    sip_round(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+template <class V>
+struct value_size {
+  uint64_t operator()(V const &) const {
+    return sizeof(V);
+  }
+};
+
+template <class C, class T, class A>
+struct value_size<std::basic_string<C, T, A>> {
+  uint64_t operator()(std::basic_string<C, T, A> const &v) const {
+    return v.size() * sizeof(C);
+  }
+};
+
+template <class T, class A>
+struct value_size<std::vector<T, A>> {
+  uint64_t operator()(std::vector<T, A> const &v) const {
+    return v.size() * sizeof(T);
+  }
+};
+
+class writer {
+private:
+  std::ostream &out;
+  std::vector<char> buffer;
+  uint64_t next_queue;
+  uint64_t secret[2];
+
+  void put(uint64_t v) {
+    while (v >= 0x80) {
+      buffer.push_back(char(v | 0x80));
+      v >>= 7;
+    }
+    buffer.push_back(char(v));
+  }
+
+public:
+  explicit writer(std::ostream &o) : out(o), next_queue(0) {
+    std::random_device random;
+    for (auto &word : secret)
+      word = uint64_t(random()) << 32 ^ random();
+    out.write(magic, sizeof(magic));
+    buffer.reserve(1 << 16);
+  }
+
+  writer(writer const &) = delete;
+  writer &operator=(writer const &) = delete;
+
+  ~writer() {
+    flush();
+  }
+
+  uint64_t new_queue() noexcept {
+    return next_queue++;
+  }
+
+  // What the trace stores for a key with hash h.
+  uint64_t key_hash(uint64_t h) const noexcept {
+    return siphash(secret[0], secret[1], h);
+  }
+
+  void write(record const &r) {
+    buffer.push_back(char(r.code));
+    put(r.queue);
+    if (has_key(r.code))
+      put(r.key);
+    if (r.code == op::push)
+      put(r.value_size);
+    if (r.code == op::copy)
+      put(r.target);
+    if (buffer.size() >= (1 << 16) - 32)
+      flush();
+  }
+
+  void flush() {
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+    buffer.clear();
+  }
+};
+
+class reader {
+private:
+  std::istream &in;
+  bool valid;
+
+  bool get(uint64_t &v) {
+    v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      int c = in.get();
+      if (c == std::char_traits<char>::eof())
+        return false;
+      v |= uint64_t(c & 0x7f) << shift;
+      if (!(c & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+public:
+  explicit reader(std::istream &i) : in(i) {
+    char header[sizeof(magic)];
+    valid = bool(in.read(header, sizeof(header))) &&
+            std::equal(header, header + sizeof(header), magic);
+  }
+
+  bool good() const noexcept {
+    return valid;
+  }
+
+  bool next(record &r) {
+    int c = in.get();
+    if (!valid || c == std::char_traits<char>::eof())
+      return false;
+    r = record();
+    r.code = op(c);
+    if (!get(r.queue))
+      return false;
+    if (has_key(r.code) && !get(r.key))
+      return false;
+    if (r.code == op::push && !get(r.value_size))
+      return false;
+    if (r.code == op::copy && !get(r.target))
+      return false;
+    return true;
+  }
+};
+
+} // namespace trace
+
+// keyed_queue that logs each operation to a trace::writer before doing it.
+// Copies log a copy record and get an id of their own, so a replay sees
+// the same sharing and copy-on-write detaches as the recorded program.
+template <class K, class V, class Alloc = std::allocator<std::pair<const K, V>>,
+          class Hash = std::hash<K>, class Size = trace::value_size<V>>
+class recording_keyed_queue {
+private:
+  using queue_type = keyed_queue<K, V, Alloc>;
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  queue_type queue;
+  std::shared_ptr<trace::writer> log;
+  uint64_t id;
+
+  void record(trace::op code, K const *k = nullptr, V const *v = nullptr) const {
+    trace::record r = trace::record();
+    r.code = code;
+    r.queue = id;
+    if (k != nullptr)
+      r.key = log->key_hash(Hash()(*k));
+    if (v != nullptr)
+      r.value_size = Size()(*v);
+    log->write(r);
+  }
+
+public:
+  using k_iterator = typename queue_type::k_iterator;
+
+  explicit recording_keyed_queue(std::shared_ptr<trace::writer> w, Alloc const &a = Alloc())
+      : queue(a), log(std::move(w)), id(log->new_queue()) {
+  }
+
+  recording_keyed_queue(recording_keyed_queue const &r)
+      : queue(r.queue), log(r.log), id(log->new_queue()) {
+    trace::record c = trace::record();
+    c.code = trace::op::copy;
+    c.queue = r.id;
+    c.target = id;
+    log->write(c);
+  }
+
+  recording_keyed_queue &operator=(recording_keyed_queue o) {
+    record(trace::op::destroy);
+    queue = std::move(o.queue);
+    trace::record c = trace::record();
+    c.code = trace::op::copy;
+    c.queue = o.id;
+    c.target = id;
+    log->write(c);
+    return *this;
+  }
+
+  ~recording_keyed_queue() {
+    if (log)
+      record(trace::op::destroy);
+  }
+
+  void push(K const &k, V const &v) {
+    record(trace::op::push, &k, &v);
+    queue.push(k, v);
+  }
+
+  void pop() {
+    record(trace::op::pop);
+    queue.pop();
+  }
+
+  void pop(K const &k) {
+    record(trace::op::pop_key, &k);
+    queue.pop(k);
+  }
+
+  void move_to_back(K const &k) {
+    record(trace::op::move_to_back, &k);
+    queue.move_to_back(k);
+  }
+
+  CKey_Value front() {
+    record(trace::op::front);
+    return queue.front();
+  }
+
+  CKey_Value back() {
+    record(trace::op::back);
+    return queue.back();
+  }
+
+  CKey_CValue front() const {
+    record(trace::op::const_front);
+    return static_cast<queue_type const &>(queue).front();
+  }
+
+  CKey_CValue back() const {
+    record(trace::op::const_back);
+    return static_cast<queue_type const &>(queue).back();
+  }
+
+  CKey_Value first(K const &k) {
+    record(trace::op::first, &k);
+    return queue.first(k);
+  }
+
+  CKey_Value last(K const &k) {
+    record(trace::op::last, &k);
+    return queue.last(k);
+  }
+
+  CKey_CValue first(K const &k) const {
+    record(trace::op::const_first, &k);
+    return static_cast<queue_type const &>(queue).first(k);
+  }
+
+  CKey_CValue last(K const &k) const {
+    record(trace::op::const_last, &k);
+    return static_cast<queue_type const &>(queue).last(k);
+  }
+
+  size_t count(K const &k) const {
+    record(trace::op::count, &k);
+    return queue.count(k);
+  }
+
+  void clear() {
+    record(trace::op::clear);
+    queue.clear();
+  }
+
+  size_t size() const noexcept {
+    return queue.size();
+  }
+
+  bool empty() const noexcept {
+    return queue.empty();
+  }
+
+  k_iterator k_begin() const noexcept {
+    return queue.k_begin();
+  }
+
+  k_iterator k_end() const noexcept {
+    return queue.k_end();
+  }
+};
+
+#endif /* RECORDING_KEYED_QUEUE_H */
@@ -0,0 +1,568 @@
+#ifndef RING_KEYED_QUEUE_H
+#define RING_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <functional>
+
+// keyed_queue with its entries in a growable circular buffer, in queue
+// order, instead of list nodes. Every entry has a sequence number and sits
+// in slot seq & mask; each key keeps the sequence numbers of its entries.
+// Removals in the middle (pop(k), the old places of move_to_back) leave
+// tombstones that are skipped at the ends. Once tombstones reach half the
+// live entries, a compaction starts that slides live entries towards the
+// back over the tombstones, a few slots per mutation, rewriting each moved
+// entry's sequence number in its key's list; no single operation pays for
+// the whole buffer except when it has to grow.
+//
+// move_to_back and growth move values with std::move_if_noexcept, so a
+// value type whose move may throw is copied and the strong guarantee holds.
+//
+// Same interface and copy-on-write sharing as keyed_queue; references
+// returned from it stay valid only until the next mutation.
+template <class K, class V, class Alloc = std::allocator<std::pair<const K, V>>>
+class ring_keyed_queue {
+private:
+  template <class T>
+  using rebind_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  class base_queue {
+  private:
+    using seqs_t = std::vector<uint64_t, rebind_alloc<uint64_t>>;
+    using node_t = std::pair<const K, seqs_t>;
+    using nodes_t = std::map<K, seqs_t, KEYED_QUEUE_KEY_LESS(K), rebind_alloc<node_t>>;
+    // Each entry points at its key's node, so that a compaction renumbers
+    // it without a lookup.
+    using entry_t = std::pair<node_t *, V>;
+    using slot_t = std::optional<entry_t>;
+    using slots_t = std::vector<slot_t, rebind_alloc<slot_t>>;
+    using nodes_it_t = typename nodes_t::const_iterator;
+
+    static const size_t min_capacity = 8;
+    // Slots a compaction advances per mutation, on top of one per entry
+    // the mutation tombstoned.
+    static const size_t compact_steps = 4;
+
+    slots_t slots;
+    nodes_t nodes;
+    uint64_t head;
+    uint64_t tail;
+    size_t live;
+    // A compaction in progress: slots [head, scan) are still to be looked
+    // at, [scan, fill) are tombstones and [fill, tail) holds what it moved
+    // and what was pushed since.
+    bool compacting;
+    uint64_t scan;
+    uint64_t fill;
+    bool unshareable;
+
+    slot_t &at(uint64_t seq) {
+      return slots[seq & (slots.size() - 1)];
+    }
+
+    slot_t const &at(uint64_t seq) const {
+      return slots[seq & (slots.size() - 1)];
+    }
+
+    size_t tombstones() const noexcept {
+      return size_t(tail - head) - live;
+    }
+
+    // Moves the live entries to a new buffer of the given capacity,
+    // numbered from 0, and rewrites every key's sequence numbers. Values
+    // are copied unless their move cannot throw, so a failure leaves the
+    // old buffer intact.
+    void relocate(size_t capacity) {
+      KEYED_QUEUE_CLONE(live);
+      KEYED_QUEUE_VISIT(size_t(tail - head) + live);
+      slots_t fresh(capacity, slots.get_allocator());
+      seqs_t renumbered(size_t(tail - head), 0, slots.get_allocator());
+      uint64_t seq = 0;
+      for (uint64_t s = head; s != tail; ++s)
+        if (at(s)) {
+          renumbered[s - head] = seq;
+          fresh[seq++].emplace(std::move_if_noexcept(*at(s)));
+        }
+
+      for (auto &node : nodes)
+        for (auto &s : node.second)
+          s = renumbered[s - head];
+      slots.swap(fresh);
+      head = 0;
+      tail = seq;
+      compacting = false;
+    }
+
+    static size_t capacity_for(size_t n) noexcept {
+      size_t c = min_capacity;
+      while (c < 2 * n)
+        c *= 2;
+      return c;
+    }
+
+    // Makes room for n more entries at the back; afterwards at most half of
+    // the buffer is in use, so relocations are amortised over pushes.
+    void reserve_back(size_t n) {
+      if (slots.size() - size_t(tail - head) >= n)
+        return;
+      relocate(capacity_for(live + n));
+    }
+
+    // Skips tombstones at both ends. The head passing scan means it also
+    // passed the tombstones up to fill and the compaction is done; the
+    // tail falling below fill means it fell to scan or below.
+    void trim() noexcept {
+      while (head != tail && !at(head)) {
+        KEYED_QUEUE_VISIT(1);
+        ++head;
+      }
+      while (tail != head && !at(tail - 1)) {
+        KEYED_QUEUE_VISIT(1);
+        --tail;
+      }
+      if (!compacting)
+        return;
+      if (head >= scan)
+        compacting = false;
+      else if (tail < fill)
+        scan = fill = tail;
+    }
+
+    // Moves the entry at seq to the free slot to above it and renumbers it
+    // in its key's list. The slots between the two are tombstones, so the
+    // list stays sorted.
+    void slide(uint64_t seq, uint64_t to) {
+      auto &seqs = at(seq)->first->second;
+      auto s = std::lower_bound(seqs.begin(), seqs.end(), seq);
+      at(to).emplace(std::move_if_noexcept(*at(seq)));
+      at(seq).reset();
+      *s = to;
+    }
+
+    // Advances the compaction by up to steps slots, starting one if
+    // tombstones have reached half the live entries. Runs once a mutation
+    // is complete, so a value that fails to copy only ends the compaction
+    // and leaves its tombstones for the next one.
+    void compact(size_t steps) noexcept {
+      if (!compacting) {
+        if (2 * tombstones() < live || tombstones() < min_capacity)
+          return;
+        compacting = true;
+        scan = fill = tail;
+      }
+
+      try {
+        for (; steps != 0 && scan != head; --steps) {
+          KEYED_QUEUE_VISIT(1);
+          uint64_t seq = scan - 1;
+          if (at(seq)) {
+            if (seq != fill - 1)
+              slide(seq, fill - 1);
+            --fill;
+          }
+          scan = seq;
+        }
+      }
+      catch (...) {
+        compacting = false;
+        return;
+      }
+
+      if (scan == head) {
+        head = fill;
+        compacting = false;
+      }
+    }
+
+    void tombstone(uint64_t seq) {
+      at(seq).reset();
+      --live;
+      trim();
+      compact(compact_steps + 1);
+    }
+
+    [[noreturn]] void fail() const {
+      keyed_queue_fail(this);
+    }
+
+  public:
+    explicit base_queue(Alloc const &a)
+        : slots(a), nodes(a), head(0), tail(0), live(0), compacting(false), scan(0), fill(0), unshareable(false) {
+    }
+
+    // Copies only the live entries, renumbered from 0 into a buffer at most
+    // half full, so the copy leaves the tombstones behind and the mutation
+    // that caused it does not have to grow the buffer as well.
+    base_queue(base_queue const &b)
+        : slots(capacity_for(b.live), b.slots.get_allocator()), nodes(b.nodes), head(0), tail(0),
+          live(b.live), compacting(false), scan(0), fill(0), unshareable(false) {
+      KEYED_QUEUE_CLONE(live);
+      KEYED_QUEUE_VISIT(size_t(b.tail - b.head) + live);
+      seqs_t renumbered(size_t(b.tail - b.head), 0, slots.get_allocator());
+      for (uint64_t s = b.head; s != b.tail; ++s)
+        if (b.at(s)) {
+          renumbered[s - b.head] = tail;
+          at(tail++).emplace(*b.at(s));
+        }
+
+      for (auto &node : nodes)
+        for (auto &s : node.second) {
+          s = renumbered[s - b.head];
+          at(s)->first = &node;
+        }
+    }
+
+    Alloc get_allocator() const {
+      return Alloc(slots.get_allocator());
+    }
+
+    bool get_unshareable() const {
+      return unshareable;
+    }
+
+    void set_unshareable() {
+      unshareable = true;
+    }
+
+    void check_empty() const {
+      if (live == 0)
+        fail();
+    }
+
+    void check_no_key(K const &k) const {
+      if (nodes.find(k) == nodes.end())
+        fail();
+    }
+
+    void push(K const &k, V const &v) {
+      reserve_back(1);
+      KEYED_QUEUE_VISIT(1);
+      at(tail).emplace(nullptr, v);
+      try {
+        auto inserted = nodes.try_emplace(k, slots.get_allocator());
+        try {
+          inserted.first->second.push_back(tail);
+        }
+        catch (...) {
+          if (inserted.second)
+            nodes.erase(inserted.first);
+          throw;
+        }
+        at(tail)->first = &*(inserted.first);
+      }
+      catch (...) {
+        at(tail).reset();
+        throw;
+      }
+      ++tail;
+      ++live;
+      compact(compact_steps);
+    }
+
+    void pop() {
+      check_empty();
+      KEYED_QUEUE_VISIT(1);
+      auto nodes_it = nodes.find(at(tail - 1)->first->first);
+      if (nodes_it->second.size() == 1)
+        nodes.erase(nodes_it);
+      else
+        nodes_it->second.pop_back();
+      at(tail - 1).reset();
+      --live;
+      trim();
+      compact(compact_steps);
+    }
+
+    void pop(K const &k) {
+      auto nodes_it = nodes.find(k);
+      if (nodes_it == nodes.end())
+        fail();
+      uint64_t seq = nodes_it->second.back();
+      KEYED_QUEUE_VISIT(1);
+      if (nodes_it->second.size() == 1)
+        nodes.erase(nodes_it);
+      else
+        nodes_it->second.pop_back();
+      tombstone(seq);
+    }
+
+    void move_to_back(K const &k) {
+      auto nodes_it = nodes.find(k);
+      if (nodes_it == nodes.end())
+        fail();
+      auto &seqs = nodes_it->second;
+      reserve_back(seqs.size());
+      KEYED_QUEUE_VISIT(seqs.size());
+
+      // Entries are only taken out of their old slots once all of them are
+      // in place at the back; a copy that throws undoes the others.
+      size_t moved = 0;
+      try {
+        for (auto s : seqs) {
+          at(tail + moved).emplace(std::move_if_noexcept(*at(s)));
+          ++moved;
+        }
+      }
+      catch (...) {
+        for (; moved != 0; --moved)
+          at(tail + moved - 1).reset();
+        throw;
+      }
+
+      for (auto &s : seqs) {
+        at(s).reset();
+        s = tail++;
+      }
+      trim();
+      compact(compact_steps + seqs.size());
+    }
+
+    CKey_Value front() {
+      return CKey_Value(at(head)->first->first, at(head)->second);
+    }
+
+    CKey_Value back() {
+      return CKey_Value(at(tail - 1)->first->first, at(tail - 1)->second);
+    }
+
+    CKey_CValue front() const {
+      return CKey_CValue(at(head)->first->first, at(head)->second);
+    }
+
+    CKey_CValue back() const {
+      return CKey_CValue(at(tail - 1)->first->first, at(tail - 1)->second);
+    }
+
+    CKey_Value first(K const &k) {
+      auto &slot = at(nodes.find(k)->second.front());
+      return CKey_Value(slot->first->first, slot->second);
+    }
+
+    CKey_Value last(K const &k) {
+      auto &slot = at(nodes.find(k)->second.back());
+      return CKey_Value(slot->first->first, slot->second);
+    }
+
+    CKey_CValue first(K const &k) const {
+      auto const &slot = at(nodes.find(k)->second.front());
+      return CKey_CValue(slot->first->first, slot->second);
+    }
+
+    CKey_CValue last(K const &k) const {
+      auto const &slot = at(nodes.find(k)->second.back());
+      return CKey_CValue(slot->first->first, slot->second);
+    }
+
+    size_t size() const noexcept {
+      return live;
+    }
+
+    bool empty() const noexcept {
+      return live == 0;
+    }
+
+    void clear() noexcept {
+      KEYED_QUEUE_VISIT(live);
+      nodes.clear();
+      slots.clear();
+      head = tail = 0;
+      live = 0;
+      compacting = false;
+    }
+
+    size_t count(K const &k) const {
+      auto nodes_it = nodes.find(k);
+      if (nodes_it == nodes.end())
+        return 0;
+      return nodes_it->second.size();
+    }
+
+    template <class F>
+    void for_each(F &f) const {
+      KEYED_QUEUE_VISIT(size_t(tail - head));
+      for (uint64_t s = head; s != tail; ++s)
+        if (at(s))
+          f(at(s)->first->first, at(s)->second);
+    }
+
+    // Slots of the buffer, live or tombstoned, between the ends.
+    size_t span() const noexcept {
+      return size_t(tail - head);
+    }
+
+    class k_iterator {
+    friend class base_queue;
+
+    private:
+      nodes_it_t iterator;
+
+      k_iterator(nodes_it_t it) : iterator(it) {}
+
+    public:
+      k_iterator() {
+      }
+
+      k_iterator(const k_iterator &k) : iterator(k.iterator) {
+      }
+
+      k_iterator& operator++() noexcept {
+        ++iterator;
+        return *this;
+      }
+
+      bool operator==(k_iterator const &k) const noexcept {
+        return iterator == k.iterator;
+      }
+
+      bool operator!=(k_iterator const &k) const noexcept {
+        return !(*this == k);
+      }
+
+      const K& operator*() const noexcept {
+        return iterator->first;
+      }
+
+    };
+
+    k_iterator k_begin() const {
+      return k_iterator(nodes.begin());
+    }
+
+    k_iterator k_end() const {
+      return k_iterator(nodes.end());
+    }
+
+  };
+
+  keyed_queue_cow<base_queue, Alloc> queue_ptr;
+
+public:
+  using k_iterator = typename base_queue::k_iterator;
+
+  ring_keyed_queue() : ring_keyed_queue(Alloc()) {
+  }
+
+  explicit ring_keyed_queue(Alloc const &a) : queue_ptr(a) {
+  }
+
+  void push(K const &k, V const &v) {
+    queue_ptr.write([&](base_queue &b) {
+      b.push(k, v);
+    });
+  }
+
+  void pop() {
+    queue_ptr->check_empty();
+    queue_ptr.write([](base_queue &b) {
+      b.pop();
+    });
+  }
+
+  void pop(K const &k) {
+    queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.pop(k);
+    });
+  }
+
+  void move_to_back(K const &k) {
+    queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.move_to_back(k);
+    });
+  }
+
+  CKey_Value front() {
+    queue_ptr->check_empty();
+    return queue_ptr.mutate().front();
+  }
+
+  CKey_Value back() {
+    queue_ptr->check_empty();
+    return queue_ptr.mutate().back();
+  }
+
+  CKey_CValue front() const {
+    queue_ptr->check_empty();
+    return queue_ptr->front();
+  }
+
+  CKey_CValue back() const {
+    queue_ptr->check_empty();
+    return queue_ptr->back();
+  }
+
+  CKey_Value first(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.mutate().first(k);
+  }
+
+  CKey_Value last(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.mutate().last(k);
+  }
+
+  CKey_CValue first(K const &k) const {
+    queue_ptr->check_no_key(k);
+    return queue_ptr->first(k);
+  }
+
+  CKey_CValue last(K const &k) const {
+    queue_ptr->check_no_key(k);
+    return queue_ptr->last(k);
+  }
+
+  size_t size() const noexcept {
+    return queue_ptr->size();
+  }
+
+  bool empty() const noexcept {
+    return queue_ptr->empty();
+  }
+
+  void clear() {
+    queue_ptr.clear();
+  }
+
+  size_t count(K const &k) const {
+    return queue_ptr->count(k);
+  }
+
+  // Buffer slots between the ends, including tombstones; size() / span()
+  // is the live fraction.
+  size_t span() const noexcept {
+    return queue_ptr->span();
+  }
+
+  Alloc get_allocator() const {
+    return queue_ptr->get_allocator();
+  }
+
+  // Calls f(k, v) for every element, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    queue_ptr->for_each(f);
+  }
+
+  k_iterator k_begin() const noexcept {
+    return queue_ptr->k_begin();
+  }
+
+  k_iterator k_end() const noexcept {
+    return queue_ptr->k_end();
+  }
+
+};
+
+#endif /* RING_KEYED_QUEUE_H */
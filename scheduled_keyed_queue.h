@@ -0,0 +1,222 @@
+#ifndef SCHEDULED_KEYED_QUEUE_H
+#define SCHEDULED_KEYED_QUEUE_H
+
+#include "keyed_queue_visibility.h"
+#include "timing_wheel.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+// keyed_queue whose entries can be pushed with a not-before time. A
+// scheduled entry takes its place in the queue at once and counts in
+// size(), count(k) and the keys, but front(), back(), pop, the first(k)
+// family and for_each step over it until it is due.
+//
+// Scheduled entries are hidden in the representation under a ticket that
+// waits in a timing_wheel, so an entry is released at most one tick late
+// and never early. The wheel holds tickets rather than positions because
+// copies share the representation until one of them changes it. The
+// non-const accessors first release whatever is due by Clock::now(); the
+// const ones show the queue as of the last advance().
+template <class K, class V, class Clock = std::chrono::steady_clock,
+          class Alloc = std::allocator<std::pair<const K, V>>>
+class scheduled_keyed_queue {
+public:
+  using time_point = typename Clock::time_point;
+  using duration = typename Clock::duration;
+
+private:
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+  using base_queue = keyed_queue_visibility<K, V, Alloc>;
+
+  keyed_queue_cow<base_queue, Alloc> queue_ptr;
+  timing_wheel<uint64_t, Clock> wheel;
+  uint64_t next_ticket;
+
+public:
+  using k_iterator = typename base_queue::k_iterator;
+
+  explicit scheduled_keyed_queue(duration tick = std::chrono::milliseconds(1), size_t slots = 4096,
+                                 Alloc const &a = Alloc())
+      : queue_ptr(a), wheel(tick, slots), next_ticket(1) {
+  }
+
+  // Releases, in due order, every scheduled entry due by now. The queue is
+  // only detached if an entry is still there to release.
+  void advance(time_point now) {
+    typename keyed_queue_cow<base_queue, Alloc>::pointer ptr;
+    wheel.advance(now, [&](uint64_t ticket) {
+      if (!ptr) {
+        if (!queue_ptr->has_ticket(ticket))
+          return;
+        ptr = queue_ptr.writable();
+      }
+      ptr->reveal(ticket);
+    });
+    if (ptr)
+      queue_ptr.commit(ptr);
+  }
+
+  void advance() {
+    advance(Clock::now());
+  }
+
+  void push(K const &k, V const &v) {
+    queue_ptr.write([&](base_queue &b) {
+      b.push(k, v);
+    });
+  }
+
+  void push_at(K const &k, V const &v, time_point when) {
+    if (wheel.due(when)) {
+      push(k, v);
+      return;
+    }
+
+    // A ticket left in the wheel by a failed push is released as nothing.
+    uint64_t ticket = next_ticket++;
+    wheel.schedule(ticket, when);
+    queue_ptr.write([&](base_queue &b) {
+      b.push_hidden(k, v, ticket);
+    });
+  }
+
+  void push_after(K const &k, V const &v, duration delay) {
+    push_at(k, v, Clock::now() + delay);
+  }
+
+  void pop() {
+    advance();
+    queue_ptr->check_visible();
+    queue_ptr.write([](base_queue &b) {
+      b.pop();
+    });
+  }
+
+  void pop(K const &k) {
+    advance();
+    queue_ptr->check_visible(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.pop(k);
+    });
+  }
+
+  void move_to_back(K const &k) {
+    advance();
+    queue_ptr->check_no_key(k);
+    queue_ptr.write([&](base_queue &b) {
+      b.move_to_back(k);
+    });
+  }
+
+  // Removes every entry with key k, scheduled ones too, and returns how
+  // many there were.
+  size_t pop_all(K const &k) {
+    queue_ptr->check_no_key(k);
+    return queue_ptr.write([&](base_queue &b) {
+      return b.pop_all(k);
+    });
+  }
+
+  // Removes every entry, scheduled ones too, for which pred(k, v) holds and
+  // returns how many there were.
+  template <class Pred>
+  size_t erase_if(Pred pred) {
+    auto positions = queue_ptr->match(pred);
+    if (positions.empty())
+      return 0;
+    queue_ptr.write([&](base_queue &b) {
+      b.erase_positions(positions);
+    });
+    return positions.size();
+  }
+
+  CKey_Value front() {
+    advance();
+    queue_ptr->check_visible();
+    return queue_ptr.mutate().front();
+  }
+
+  CKey_Value back() {
+    advance();
+    queue_ptr->check_visible();
+    return queue_ptr.mutate().back();
+  }
+
+  CKey_CValue front() const {
+    queue_ptr->check_visible();
+    return queue_ptr->front();
+  }
+
+  CKey_CValue back() const {
+    queue_ptr->check_visible();
+    return queue_ptr->back();
+  }
+
+  CKey_Value first(K const &k) {
+    advance();
+    queue_ptr->check_visible(k);
+    return queue_ptr.mutate().first(k);
+  }
+
+  CKey_Value last(K const &k) {
+    advance();
+    queue_ptr->check_visible(k);
+    return queue_ptr.mutate().last(k);
+  }
+
+  CKey_CValue first(K const &k) const {
+    return queue_ptr->first(k);
+  }
+
+  CKey_CValue last(K const &k) const {
+    return queue_ptr->last(k);
+  }
+
+  // Visible and scheduled entries.
+  size_t size() const noexcept {
+    return queue_ptr->size();
+  }
+
+  bool empty() const noexcept {
+    return queue_ptr->empty();
+  }
+
+  size_t count(K const &k) const {
+    return queue_ptr->count(k);
+  }
+
+  // Entries not due yet.
+  size_t scheduled_size() const noexcept {
+    return queue_ptr->hidden_size();
+  }
+
+  void clear() {
+    queue_ptr.clear();
+    wheel.clear();
+  }
+
+  Alloc get_allocator() const {
+    return queue_ptr->get_allocator();
+  }
+
+  // Calls f(k, v) for every visible entry, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    queue_ptr->for_each(f);
+  }
+
+  // Keys with visible or scheduled entries.
+  k_iterator k_begin() const noexcept {
+    return queue_ptr->k_begin();
+  }
+
+  k_iterator k_end() const noexcept {
+    return queue_ptr->k_end();
+  }
+};
+
+#endif /* SCHEDULED_KEYED_QUEUE_H */
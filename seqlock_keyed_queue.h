@@ -0,0 +1,333 @@
+#ifndef SEQLOCK_KEYED_QUEUE_H
+#define SEQLOCK_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+
+// keyed_queue for one writer thread and any number of reader threads.
+// The writer brackets every mutation with a sequence counter and publishes
+// size(), the front element and per-key counts into a mirror that readers
+// copy optimistically and validate against the counter, so readers never
+// write a shared cache line and never wait for the writer.
+//
+// Mirrored keys and values are copied word by word, which is why both have
+// to be trivially copyable.
+template <class K, class V, class Hash = std::hash<K>, class KeyEqual = std::equal_to<K>>
+class seqlock_keyed_queue {
+  static_assert(std::is_trivially_copyable<K>::value, "seqlock_keyed_queue needs trivially copyable keys");
+  static_assert(std::is_trivially_copyable<V>::value, "seqlock_keyed_queue needs trivially copyable values");
+
+public:
+  using queue_type = keyed_queue<K, V>;
+
+  struct snapshot {
+    size_t size;
+    K key;
+    V value;
+  };
+
+private:
+  static const size_t front_words = (sizeof(K) + sizeof(V) + 7) / 8;
+  static const size_t key_words = (sizeof(K) + 7) / 8;
+
+  // A slot whose count is zero may be handed to another key, and a rehash
+  // rewrites a table in place, so keys are stored word by word like the
+  // front element and only change inside a write section.
+  struct slot {
+    std::atomic<bool> used;
+    std::atomic<size_t> count;
+    std::atomic<uint64_t> key[key_words];
+
+    slot() : used(false), count(0) {
+      for (size_t i = 0; i < key_words; ++i)
+        key[i].store(0, std::memory_order_relaxed);
+    }
+
+    K load_key() const noexcept {
+      uint64_t words[key_words];
+      for (size_t i = 0; i < key_words; ++i)
+        words[i] = key[i].load(std::memory_order_relaxed);
+      K k;
+      std::memcpy(&k, words, sizeof(K));
+      return k;
+    }
+
+    void store_key(K const &k) noexcept {
+      uint64_t words[key_words] = {};
+      std::memcpy(words, &k, sizeof(K));
+      for (size_t i = 0; i < key_words; ++i)
+        key[i].store(words[i], std::memory_order_relaxed);
+    }
+  };
+
+  struct table {
+    std::unique_ptr<slot[]> slots;
+    size_t mask;
+    size_t used;
+
+    explicit table(size_t capacity) : slots(new slot[capacity]), mask(capacity - 1), used(0) {
+    }
+  };
+
+  queue_type queue;
+  Hash hash;
+  KeyEqual equal;
+
+  alignas(64) std::atomic<uint64_t> sequence;
+  std::atomic<size_t> mirrored_size;
+  std::atomic<uint64_t> mirrored_front[front_words];
+  std::atomic<table *> counts;
+
+  // Tables replaced by a larger one stay allocated, since a reader may still
+  // be probing them. A table is only replaced once a quarter of it holds
+  // live keys, and the replacement is at least twice as large, so the
+  // retired tables together are smaller than the live one; churn through
+  // short-lived keys reuses zero-count slots or rehashes in place instead.
+  alignas(64) std::vector<std::unique_ptr<table>> tables;
+
+  slot *find_slot(table &t, K const &k) const {
+    for (size_t i = hash(k) & t.mask;; i = (i + 1) & t.mask) {
+      slot &s = t.slots[i];
+      if (!s.used.load(std::memory_order_acquire))
+        return &s;
+      if (equal(s.load_key(), k))
+        return &s;
+    }
+  }
+
+  static void insert(table &t, slot &target, K const &k, size_t c) noexcept {
+    target.store_key(k);
+    target.count.store(c, std::memory_order_relaxed);
+    target.used.store(true, std::memory_order_release);
+    ++t.used;
+  }
+
+  // Drops keys whose count fell to zero, rehashing in place while at most
+  // a quarter of the table would stay live and into a table four times the
+  // live keys otherwise. Called inside a write section.
+  void rehash() {
+    table &old = *counts.load(std::memory_order_relaxed);
+    std::vector<std::pair<K, size_t>> live;
+    for (size_t i = 0; i <= old.mask; ++i) {
+      slot &s = old.slots[i];
+      size_t c = s.count.load(std::memory_order_relaxed);
+      if (s.used.load(std::memory_order_relaxed) && c != 0)
+        live.emplace_back(s.load_key(), c);
+    }
+
+    if (4 * (live.size() + 1) <= old.mask + 1) {
+      for (size_t i = 0; i <= old.mask; ++i)
+        old.slots[i].used.store(false, std::memory_order_relaxed);
+      old.used = 0;
+      for (auto const &entry : live)
+        insert(old, *find_slot(old, entry.first), entry.first, entry.second);
+      return;
+    }
+
+    size_t capacity = 16;
+    while (capacity < 4 * (live.size() + 1))
+      capacity <<= 1;
+
+    tables.reserve(tables.size() + 1);
+    std::unique_ptr<table> grown(new table(capacity));
+    for (auto const &entry : live)
+      insert(*grown, *find_slot(*grown, entry.first), entry.first, entry.second);
+
+    counts.store(grown.get(), std::memory_order_release);
+    tables.push_back(std::move(grown));
+  }
+
+  // Makes sure a slot for k exists before the queue is touched, so a failed
+  // allocation leaves both the queue and the mirror unchanged. A new key
+  // takes the first zero-count slot on its probe sequence if there is one.
+  slot *reserve_slot(K const &k) {
+    table *t = counts.load(std::memory_order_relaxed);
+    slot *reusable = nullptr;
+    for (size_t i = hash(k) & t->mask;; i = (i + 1) & t->mask) {
+      slot &s = t->slots[i];
+      if (!s.used.load(std::memory_order_relaxed))
+        break;
+      if (equal(s.load_key(), k))
+        return &s;
+      if (!reusable && s.count.load(std::memory_order_relaxed) == 0)
+        reusable = &s;
+    }
+
+    begin_write();
+    if (reusable) {
+      reusable->store_key(k);
+      end_write();
+      return reusable;
+    }
+
+    if (2 * (t->used + 1) > t->mask + 1) {
+      try {
+        rehash();
+      }
+      catch (...) {
+        end_write();
+        throw;
+      }
+      t = counts.load(std::memory_order_relaxed);
+    }
+
+    slot *s = find_slot(*t, k);
+    insert(*t, *s, k, 0);
+    end_write();
+    return s;
+  }
+
+  void begin_write() noexcept {
+    sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void end_write() noexcept {
+    sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  void publish_front() noexcept {
+    queue_type const &q = queue;
+    mirrored_size.store(q.size(), std::memory_order_relaxed);
+    if (q.empty())
+      return;
+
+    uint64_t words[front_words] = {};
+    auto entry = q.front();
+    std::memcpy(words, &entry.first, sizeof(K));
+    std::memcpy(reinterpret_cast<char *>(words) + sizeof(K), &entry.second, sizeof(V));
+    for (size_t i = 0; i < front_words; ++i)
+      mirrored_front[i].store(words[i], std::memory_order_relaxed);
+  }
+
+  void adjust_count(K const &k, long delta) noexcept {
+    slot *s = find_slot(*counts.load(std::memory_order_relaxed), k);
+    s->count.store(s->count.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  template <class F>
+  auto read(F f) const -> decltype(f()) {
+    for (;;) {
+      uint64_t before = sequence.load(std::memory_order_acquire);
+      if (before & 1)
+        continue;
+      auto result = f();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence.load(std::memory_order_relaxed) == before)
+        return result;
+    }
+  }
+
+public:
+  seqlock_keyed_queue(Hash const &h = Hash(), KeyEqual const &e = KeyEqual())
+      : hash(h), equal(e), sequence(0), mirrored_size(0) {
+    for (size_t i = 0; i < front_words; ++i)
+      mirrored_front[i].store(0, std::memory_order_relaxed);
+    tables.emplace_back(new table(16));
+    counts.store(tables.back().get(), std::memory_order_relaxed);
+  }
+
+  seqlock_keyed_queue(seqlock_keyed_queue const &) = delete;
+  seqlock_keyed_queue &operator=(seqlock_keyed_queue const &) = delete;
+
+  // Writer side. Each call is one write section.
+
+  void push(K const &k, V const &v) {
+    reserve_slot(k);
+    queue.push(k, v);
+    begin_write();
+    adjust_count(k, 1);
+    publish_front();
+    end_write();
+  }
+
+  void pop() {
+    queue_type const &q = queue;
+    K k = q.back().first;
+    queue.pop();
+    begin_write();
+    adjust_count(k, -1);
+    publish_front();
+    end_write();
+  }
+
+  void pop(K const &k) {
+    queue.pop(k);
+    begin_write();
+    adjust_count(k, -1);
+    publish_front();
+    end_write();
+  }
+
+  void move_to_back(K const &k) {
+    queue.move_to_back(k);
+    begin_write();
+    publish_front();
+    end_write();
+  }
+
+  void clear() {
+    queue.clear();
+    begin_write();
+    table &t = *counts.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= t.mask; ++i)
+      t.slots[i].count.store(0, std::memory_order_relaxed);
+    publish_front();
+    end_write();
+  }
+
+  // The writer may read the queue directly; readers must not.
+  queue_type const &writer_view() const noexcept {
+    return queue;
+  }
+
+  // Reader side. Safe from any thread, concurrently with the writer.
+
+  size_t size() const noexcept {
+    return mirrored_size.load(std::memory_order_acquire);
+  }
+
+  bool empty() const noexcept {
+    return size() == 0;
+  }
+
+  size_t count(K const &k) const {
+    return read([&] {
+      table &t = *counts.load(std::memory_order_acquire);
+      for (size_t i = hash(k) & t.mask;; i = (i + 1) & t.mask) {
+        slot &s = t.slots[i];
+        if (!s.used.load(std::memory_order_acquire))
+          return size_t(0);
+        if (equal(s.load_key(), k))
+          return s.count.load(std::memory_order_relaxed);
+      }
+    });
+  }
+
+  // Consistent size and front element; throws lookup_error if empty.
+  snapshot front() const {
+    snapshot result = read([&] {
+      snapshot s;
+      s.size = mirrored_size.load(std::memory_order_relaxed);
+      uint64_t words[front_words];
+      for (size_t i = 0; i < front_words; ++i)
+        words[i] = mirrored_front[i].load(std::memory_order_relaxed);
+      std::memcpy(&s.key, words, sizeof(K));
+      std::memcpy(&s.value, reinterpret_cast<char *>(words) + sizeof(K), sizeof(V));
+      return s;
+    });
+    if (result.size == 0)
+      throw lookup_error();
+    return result;
+  }
+};
+
+#endif /* SEQLOCK_KEYED_QUEUE_H */
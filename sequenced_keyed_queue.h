@@ -0,0 +1,229 @@
+#ifndef SEQUENCED_KEYED_QUEUE_H
+#define SEQUENCED_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <mutex>
+#include <queue>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <optional>
+#include <functional>
+
+// keyed_queue fed by many producer threads without a shared lock. Every
+// producer appends to its own single-producer ring, stamping each element
+// with a ticket from one global counter; the consumer merges the rings into
+// the keyed_queue by ticket whenever it looks at the queue, so front(), back()
+// and pop() see exactly the order in which the pushes took their tickets.
+//
+// All consumer calls must come from one thread at a time.
+template <class K, class V>
+class sequenced_keyed_queue {
+private:
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  struct slot {
+    uint64_t ticket;
+    std::optional<std::pair<K, V>> entry;
+  };
+
+  struct buffer {
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<bool> in_flight;
+    std::atomic<bool> retired;
+    std::unique_ptr<slot[]> slots;
+    size_t mask;
+
+    explicit buffer(size_t capacity)
+        : head(0), tail(0), in_flight(false), retired(false),
+          slots(new slot[capacity]), mask(capacity - 1) {
+    }
+  };
+
+  alignas(64) std::atomic<uint64_t> tickets;
+  size_t capacity;
+
+  std::mutex buffers_mutex;
+  std::vector<std::unique_ptr<buffer>> buffers;
+
+  keyed_queue<K, V> queue;
+
+public:
+  class producer {
+    friend class sequenced_keyed_queue;
+
+  private:
+    sequenced_keyed_queue *owner;
+    buffer *own;
+
+    producer(sequenced_keyed_queue *q, buffer *b) : owner(q), own(b) {
+    }
+
+  public:
+    producer(producer &&p) noexcept : owner(p.owner), own(p.own) {
+      p.own = nullptr;
+    }
+
+    producer(producer const &) = delete;
+    producer &operator=(producer const &) = delete;
+    producer &operator=(producer &&) = delete;
+
+    ~producer() {
+      if (own != nullptr)
+        own->retired.store(true, std::memory_order_release);
+    }
+
+    // Waits while the ring is full; the ticket is taken only once there is
+    // room, so the consumer never waits on a producer that waits on it.
+    void push(K const &k, V const &v) {
+      size_t t = own->tail.load(std::memory_order_relaxed);
+      while (t - own->head.load(std::memory_order_acquire) > own->mask)
+        std::this_thread::yield();
+
+      slot &s = own->slots[t & own->mask];
+      own->in_flight.store(true, std::memory_order_seq_cst);
+      try {
+        s.ticket = owner->tickets.fetch_add(1, std::memory_order_seq_cst);
+        s.entry.emplace(k, v);
+      }
+      catch (...) {
+        own->in_flight.store(false, std::memory_order_release);
+        throw;
+      }
+      own->tail.store(t + 1, std::memory_order_release);
+      own->in_flight.store(false, std::memory_order_release);
+    }
+  };
+
+  explicit sequenced_keyed_queue(size_t ring_capacity = 1024) : tickets(0), capacity(1) {
+    while (capacity < ring_capacity)
+      capacity <<= 1;
+  }
+
+  sequenced_keyed_queue(sequenced_keyed_queue const &) = delete;
+  sequenced_keyed_queue &operator=(sequenced_keyed_queue const &) = delete;
+
+  // One per producer thread; the handle must not outlive the queue.
+  producer make_producer() {
+    std::unique_ptr<buffer> b(new buffer(capacity));
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    buffers.push_back(std::move(b));
+    return producer(this, buffers.back().get());
+  }
+
+  // Moves every element whose ticket precedes the moment of the call into
+  // the keyed_queue, in ticket order. A producer that holds an earlier
+  // ticket but has not published it yet is waited for; that window is a
+  // few stores long.
+  void merge();
+
+  keyed_queue<K, V> &merged() {
+    merge();
+    return queue;
+  }
+
+  void pop() {
+    merge();
+    queue.pop();
+  }
+
+  void pop(K const &k) {
+    merge();
+    queue.pop(k);
+  }
+
+  void move_to_back(K const &k) {
+    merge();
+    queue.move_to_back(k);
+  }
+
+  CKey_Value front() {
+    merge();
+    return queue.front();
+  }
+
+  CKey_Value back() {
+    merge();
+    return queue.back();
+  }
+
+  CKey_Value first(K const &k) {
+    merge();
+    return queue.first(k);
+  }
+
+  CKey_Value last(K const &k) {
+    merge();
+    return queue.last(k);
+  }
+
+  size_t size() {
+    merge();
+    return queue.size();
+  }
+
+  bool empty() {
+    merge();
+    return queue.empty();
+  }
+
+  size_t count(K const &k) {
+    merge();
+    return queue.count(k);
+  }
+};
+
+template <class K, class V>
+void sequenced_keyed_queue<K, V>::merge() {
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+
+  uint64_t watermark = tickets.load(std::memory_order_seq_cst);
+  for (auto const &b : buffers)
+    while (b->in_flight.load(std::memory_order_seq_cst))
+      std::this_thread::yield();
+
+  using cursor = std::pair<uint64_t, size_t>;
+  std::priority_queue<cursor, std::vector<cursor>, std::greater<cursor>> heads;
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    buffer &b = *buffers[i];
+    size_t h = b.head.load(std::memory_order_relaxed);
+    if (h != b.tail.load(std::memory_order_acquire) && b.slots[h & b.mask].ticket < watermark)
+      heads.emplace(b.slots[h & b.mask].ticket, i);
+  }
+
+  while (!heads.empty()) {
+    size_t i = heads.top().second;
+    buffer &b = *buffers[i];
+    heads.pop();
+
+    size_t h = b.head.load(std::memory_order_relaxed);
+    slot &s = b.slots[h & b.mask];
+    queue.push(s.entry->first, s.entry->second);
+    s.entry.reset();
+    b.head.store(++h, std::memory_order_release);
+
+    if (h != b.tail.load(std::memory_order_acquire) && b.slots[h & b.mask].ticket < watermark)
+      heads.emplace(b.slots[h & b.mask].ticket, i);
+  }
+
+  for (size_t i = 0; i < buffers.size();) {
+    buffer &b = *buffers[i];
+    if (b.retired.load(std::memory_order_acquire) &&
+        b.head.load(std::memory_order_relaxed) == b.tail.load(std::memory_order_acquire)) {
+      buffers[i].swap(buffers.back());
+      buffers.pop_back();
+    }
+    else {
+      ++i;
+    }
+  }
+}
+
+#endif /* SEQUENCED_KEYED_QUEUE_H */
@@ -0,0 +1,160 @@
+#ifndef SHARDED_KEYED_QUEUE_H
+#define SHARDED_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+#include "keyed_queue_storage.h"
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <functional>
+
+// keyed_queue split into one partition per NUMA node. A key always lives in
+// the same partition, so per-key order is that of a single keyed_queue, and
+// each partition's storage is bound to its node. Consumers pass the node they
+// run on and only touch other partitions' cache lines when theirs is empty.
+template <class K, class V, class Hash = std::hash<K>>
+class sharded_keyed_queue {
+public:
+  using allocator_type = arena_allocator<std::pair<const K, V>>;
+  using queue_type = keyed_queue<K, V, allocator_type>;
+
+private:
+  struct alignas(64) partition {
+    mutable std::mutex mutex;
+    queue_type queue;
+    unsigned node;
+
+    partition(storage_options const &o, unsigned n) : queue(allocator_type(o)), node(n) {
+    }
+  };
+
+  std::vector<std::unique_ptr<partition>> partitions;
+  Hash hash;
+
+  bool take(partition &p, K &k, V &v) {
+    std::lock_guard<std::mutex> lock(p.mutex);
+    if (p.queue.empty())
+      return false;
+    auto const &queue = p.queue;
+    auto entry = queue.back();
+    k = entry.first;
+    v = entry.second;
+    p.queue.pop();
+    return true;
+  }
+
+public:
+  explicit sharded_keyed_queue(unsigned long node_mask = online_numa_nodes(),
+                               bool huge_pages = false, Hash const &h = Hash())
+      : hash(h) {
+    for (unsigned node = 0; node < sizeof(node_mask) * 8; ++node)
+      if (node_mask & (1ul << node))
+        partitions.emplace_back(new partition(storage_options::bound_to(node, huge_pages), node));
+    if (partitions.empty())
+      partitions.emplace_back(new partition(storage_options(), 0));
+  }
+
+  sharded_keyed_queue(sharded_keyed_queue const &) = delete;
+  sharded_keyed_queue &operator=(sharded_keyed_queue const &) = delete;
+
+  size_t partition_count() const noexcept {
+    return partitions.size();
+  }
+
+  size_t partition_of(K const &k) const {
+    return hash(k) % partitions.size();
+  }
+
+  // Index of the partition whose storage is bound to a NUMA node; nodes
+  // without a partition of their own share one.
+  size_t partition_for_node(unsigned node) const noexcept {
+    for (size_t i = 0; i < partitions.size(); ++i)
+      if (partitions[i]->node == node)
+        return i;
+    return node % partitions.size();
+  }
+
+  void push(K const &k, V const &v) {
+    partition &p = *partitions[partition_of(k)];
+    std::lock_guard<std::mutex> lock(p.mutex);
+    p.queue.push(k, v);
+  }
+
+  void pop(K const &k) {
+    partition &p = *partitions[partition_of(k)];
+    std::lock_guard<std::mutex> lock(p.mutex);
+    p.queue.pop(k);
+  }
+
+  void move_to_back(K const &k) {
+    partition &p = *partitions[partition_of(k)];
+    std::lock_guard<std::mutex> lock(p.mutex);
+    p.queue.move_to_back(k);
+  }
+
+  // Removes the element pop() would remove from the partition of the given
+  // node, stealing from the other partitions in turn only when it is empty.
+  bool try_pop(unsigned node, K &k, V &v) {
+    size_t local = partition_for_node(node);
+    if (take(*partitions[local], k, v))
+      return true;
+    for (size_t i = 1; i < partitions.size(); ++i)
+      if (take(*partitions[(local + i) % partitions.size()], k, v))
+        return true;
+    return false;
+  }
+
+  bool try_pop_local(unsigned node, K &k, V &v) {
+    return take(*partitions[partition_for_node(node)], k, v);
+  }
+
+  // Runs f on a partition's keyed_queue under its lock; this is the way to
+  // the full keyed_queue interface (front, first, k_iterator, ...).
+  template <class F>
+  auto with_partition(size_t i, F &&f) -> decltype(f(std::declval<queue_type &>())) {
+    partition &p = *partitions[i];
+    std::lock_guard<std::mutex> lock(p.mutex);
+    return f(p.queue);
+  }
+
+  template <class F>
+  auto with_key(K const &k, F &&f) -> decltype(f(std::declval<queue_type &>())) {
+    return with_partition(partition_of(k), std::forward<F>(f));
+  }
+
+  size_t size() const {
+    size_t total = 0;
+    for (auto const &p : partitions) {
+      std::lock_guard<std::mutex> lock(p->mutex);
+      total += p->queue.size();
+    }
+    return total;
+  }
+
+  bool empty() const {
+    for (auto const &p : partitions) {
+      std::lock_guard<std::mutex> lock(p->mutex);
+      if (!p->queue.empty())
+        return false;
+    }
+    return true;
+  }
+
+  size_t count(K const &k) const {
+    partition const &p = *partitions[partition_of(k)];
+    std::lock_guard<std::mutex> lock(p.mutex);
+    return p.queue.count(k);
+  }
+
+  void clear() {
+    for (auto const &p : partitions) {
+      std::lock_guard<std::mutex> lock(p->mutex);
+      p->queue.clear();
+    }
+  }
+};
+
+#endif /* SHARDED_KEYED_QUEUE_H */
@@ -0,0 +1,482 @@
+#ifndef SMALL_KEYED_QUEUE_H
+#define SMALL_KEYED_QUEUE_H
+
+#include "keyed_queue.h"
+
+#include <new>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <optional>
+#include <type_traits>
+#include <algorithm>
+#include <functional>
+
+// keyed_queue that keeps up to N entries over up to NK keys inline, in the
+// object itself: the values in queue order next to an array of their key
+// slots, and the keys in NK slots with an array of slot numbers sorted by
+// key. A small queue needs no allocation beyond what its keys and values
+// allocate; lookups are a binary search over at most NK keys and removals
+// shift at most N entries. Queues of a few entries mostly repeat a few
+// keys, so NK is kept well below N rather than paying a key slot per entry.
+//
+// The push of entry N + 1, or of key NK + 1, moves everything into a
+// keyed_queue, which then serves until removals bring the queue down to
+// N / 2 entries over at most NK keys, when it moves back inline; the gap
+// keeps a queue hovering at the threshold from converting on every
+// operation. Large queues share with copy-on-write as keyed_queue does;
+// small ones are copied entry by entry. A large queue still carries the
+// inline space, so it costs sizeof(small_keyed_queue) more than a
+// keyed_queue would.
+//
+// Same interface as keyed_queue otherwise, with V move-assignable, and
+// references returned from it valid only until the next mutation.
+template <class K, class V, size_t N = 16, class Alloc = std::allocator<std::pair<const K, V>>,
+          size_t NK = 4>
+class small_keyed_queue {
+  static_assert(N > 0 && N < 256 && NK > 0 && NK <= N, "entries and key slots are numbered in bytes");
+
+public:
+  using queue_type = keyed_queue<K, V, Alloc>;
+  static const size_t small_capacity = N;
+  static const size_t small_key_capacity = NK;
+
+private:
+  using CKey_Value = std::pair<K const &, V &>;
+  using CKey_CValue = std::pair<K const &, V const &>;
+
+  alignas(V) unsigned char value_storage[N * sizeof(V)];
+  alignas(K) unsigned char key_storage[NK * sizeof(K)];
+  // Key slot of every entry.
+  uint8_t slots[N];
+  // Entries per key slot; 0 marks a free slot.
+  uint8_t key_counts[NK];
+  uint8_t sorted[NK];
+  uint8_t entries_size;
+  uint8_t keys_size;
+  Alloc alloc;
+  std::optional<queue_type> large;
+
+  V *values() noexcept {
+    return std::launder(reinterpret_cast<V *>(value_storage));
+  }
+
+  V const *values() const noexcept {
+    return std::launder(reinterpret_cast<V const *>(value_storage));
+  }
+
+  K &key(uint8_t slot) noexcept {
+    return std::launder(reinterpret_cast<K *>(key_storage))[slot];
+  }
+
+  K const &key(uint8_t slot) const noexcept {
+    return std::launder(reinterpret_cast<K const *>(key_storage))[slot];
+  }
+
+  uint8_t *lower_bound(K const &k) {
+    return std::lower_bound(sorted, sorted + keys_size, k, [this](uint8_t slot, K const &x) {
+      return std::less<K>()(key(slot), x);
+    });
+  }
+
+  uint8_t const *lower_bound(K const &k) const {
+    return std::lower_bound(sorted, sorted + keys_size, k, [this](uint8_t slot, K const &x) {
+      return std::less<K>()(key(slot), x);
+    });
+  }
+
+  // Slot of k, or NK if k has no entries.
+  size_t find_key(K const &k) const {
+    auto pos = lower_bound(k);
+    if (pos == sorted + keys_size || std::less<K>()(k, key(*pos)))
+      return NK;
+    return *pos;
+  }
+
+  size_t check_key(K const &k) const {
+    size_t slot = find_key(k);
+    if (slot == NK)
+      keyed_queue_fail(this);
+    return slot;
+  }
+
+  // Stores k in a free slot at pos in the sorted array, with no entries yet.
+  uint8_t add_key(K const &k, uint8_t *pos) {
+    uint8_t slot = uint8_t(std::find(key_counts, key_counts + NK, 0) - key_counts);
+    ::new (static_cast<void *>(&key(slot))) K(k);
+    std::copy_backward(pos, sorted + keys_size, sorted + keys_size + 1);
+    *pos = slot;
+    ++keys_size;
+    return slot;
+  }
+
+  void erase_key(uint8_t slot) noexcept {
+    auto pos = std::find(sorted, sorted + keys_size, slot);
+    std::copy(pos + 1, sorted + keys_size, pos);
+    --keys_size;
+    key(slot).~K();
+    key_counts[slot] = 0;
+  }
+
+  void release_key(uint8_t slot) noexcept {
+    if (--key_counts[slot] == 0)
+      erase_key(slot);
+  }
+
+  void push_small(K const &k, V const &v) {
+    auto pos = lower_bound(k);
+    bool found = pos != sorted + keys_size && !std::less<K>()(k, key(*pos));
+    uint8_t slot = found ? *pos : add_key(k, pos);
+    try {
+      ::new (static_cast<void *>(values() + entries_size)) V(v);
+    }
+    catch (...) {
+      if (!found)
+        erase_key(slot);
+      throw;
+    }
+    slots[entries_size] = slot;
+    ++key_counts[slot];
+    ++entries_size;
+  }
+
+  // Whether pushing k needs a key slot that is not there.
+  bool keys_full(K const &k) const {
+    return keys_size == NK && find_key(k) == NK;
+  }
+
+  void erase_entry(size_t i) noexcept {
+    uint8_t slot = slots[i];
+    std::move(values() + i + 1, values() + entries_size, values() + i);
+    std::copy(slots + i + 1, slots + entries_size, slots + i);
+    values()[--entries_size].~V();
+    release_key(slot);
+  }
+
+  void destroy_small() noexcept {
+    for (size_t i = 0; i < entries_size; ++i)
+      values()[i].~V();
+    for (size_t slot = 0; slot < NK; ++slot)
+      if (key_counts[slot] != 0)
+        key(uint8_t(slot)).~K();
+    std::fill(key_counts, key_counts + NK, 0);
+    entries_size = 0;
+    keys_size = 0;
+  }
+
+  // The queue keeps its inline contents if building the keyed_queue fails.
+  void promote() {
+    queue_type q(alloc);
+    for (size_t i = 0; i < entries_size; ++i)
+      q.push(key(slots[i]), values()[i]);
+    large.emplace(std::move(q));
+    destroy_small();
+  }
+
+  // The removal is complete before demoting, so a failed copy only leaves
+  // the queue large.
+  void maybe_demote() noexcept {
+    if (large->size() > N / 2)
+      return;
+    size_t keys = 0;
+    for (auto it = large->k_begin(); it != large->k_end(); ++it)
+      if (++keys > NK)
+        return;
+    try {
+      large->for_each([this](K const &k, V const &v) {
+        push_small(k, v);
+      });
+    }
+    catch (...) {
+      destroy_small();
+      return;
+    }
+    large.reset();
+  }
+
+  // t, moved from if Q is an rvalue.
+  template <class Q, class T>
+  static decltype(auto) forward_member(T &t) noexcept {
+    if constexpr (std::is_lvalue_reference<Q>::value)
+      return static_cast<T const &>(t);
+    else
+      return std::move(t);
+  }
+
+  // Takes the contents of o; *this must be empty and small.
+  template <class Q>
+  void assign_from(Q &&o) {
+    if (o.large) {
+      large.emplace(*std::forward<Q>(o).large);
+      return;
+    }
+    try {
+      for (size_t slot = 0; slot < NK; ++slot)
+        if (o.key_counts[slot] != 0) {
+          ::new (static_cast<void *>(&key(uint8_t(slot)))) K(forward_member<Q>(o.key(uint8_t(slot))));
+          key_counts[slot] = o.key_counts[slot];
+        }
+      std::copy(o.sorted, o.sorted + o.keys_size, sorted);
+      keys_size = o.keys_size;
+      for (size_t i = 0; i < o.entries_size; ++i) {
+        ::new (static_cast<void *>(values() + i)) V(forward_member<Q>(o.values()[i]));
+        slots[i] = o.slots[i];
+        ++entries_size;
+      }
+    }
+    catch (...) {
+      destroy_small();
+      throw;
+    }
+  }
+
+public:
+  class k_iterator {
+  friend class small_keyed_queue;
+
+  private:
+    small_keyed_queue const *owner;
+    size_t index;
+    typename queue_type::k_iterator iterator;
+
+    k_iterator(small_keyed_queue const *q, size_t i) : owner(q), index(i) {
+    }
+
+    k_iterator(small_keyed_queue const *q, typename queue_type::k_iterator it)
+        : owner(q), index(0), iterator(it) {
+    }
+
+  public:
+    k_iterator() : owner(nullptr), index(0) {
+    }
+
+    k_iterator& operator++() noexcept {
+      if (owner->large)
+        ++iterator;
+      else
+        ++index;
+      return *this;
+    }
+
+    bool operator==(k_iterator const &k) const noexcept {
+      if (owner == nullptr || owner != k.owner)
+        return owner == k.owner;
+      return owner->large ? iterator == k.iterator : index == k.index;
+    }
+
+    bool operator!=(k_iterator const &k) const noexcept {
+      return !(*this == k);
+    }
+
+    const K& operator*() const noexcept {
+      return owner->large ? *iterator : owner->key(owner->sorted[index]);
+    }
+
+  };
+
+  small_keyed_queue() : small_keyed_queue(Alloc()) {
+  }
+
+  explicit small_keyed_queue(Alloc const &a) : entries_size(0), keys_size(0), alloc(a) {
+    std::fill(key_counts, key_counts + NK, 0);
+  }
+
+  small_keyed_queue(small_keyed_queue const &o) : small_keyed_queue(o.alloc) {
+    assign_from(o);
+  }
+
+  small_keyed_queue(small_keyed_queue &&o) : small_keyed_queue(o.alloc) {
+    assign_from(std::move(o));
+  }
+
+  small_keyed_queue &operator=(small_keyed_queue const &o) {
+    if (&o != this) {
+      small_keyed_queue copy(o);
+      clear();
+      assign_from(std::move(copy));
+    }
+    return *this;
+  }
+
+  small_keyed_queue &operator=(small_keyed_queue &&o) {
+    if (&o != this) {
+      clear();
+      assign_from(std::move(o));
+    }
+    return *this;
+  }
+
+  ~small_keyed_queue() {
+    destroy_small();
+  }
+
+  void push(K const &k, V const &v) {
+    if (!large && (entries_size == N || keys_full(k)))
+      promote();
+    if (large)
+      large->push(k, v);
+    else
+      push_small(k, v);
+  }
+
+  void pop() {
+    if (large) {
+      large->pop();
+      maybe_demote();
+      return;
+    }
+    if (entries_size == 0)
+      keyed_queue_fail(this);
+    erase_entry(entries_size - 1);
+  }
+
+  void pop(K const &k) {
+    if (large) {
+      large->pop(k);
+      maybe_demote();
+      return;
+    }
+    size_t slot = check_key(k);
+    size_t i = entries_size;
+    while (slots[--i] != slot) {
+    }
+    erase_entry(i);
+  }
+
+  void move_to_back(K const &k) {
+    if (large) {
+      large->move_to_back(k);
+      return;
+    }
+    size_t slot = check_key(k);
+    for (size_t moved = 0; moved < key_counts[slot]; ++moved) {
+      size_t i = size_t(std::find(slots, slots + entries_size - moved, slot) - slots);
+      std::rotate(values() + i, values() + i + 1, values() + entries_size);
+      std::rotate(slots + i, slots + i + 1, slots + entries_size);
+    }
+  }
+
+  CKey_Value front() {
+    if (large)
+      return large->front();
+    if (entries_size == 0)
+      keyed_queue_fail(this);
+    return CKey_Value(key(slots[0]), values()[0]);
+  }
+
+  CKey_Value back() {
+    if (large)
+      return large->back();
+    if (entries_size == 0)
+      keyed_queue_fail(this);
+    return CKey_Value(key(slots[entries_size - 1]), values()[entries_size - 1]);
+  }
+
+  CKey_CValue front() const {
+    if (large)
+      return static_cast<queue_type const &>(*large).front();
+    if (entries_size == 0)
+      keyed_queue_fail(this);
+    return CKey_CValue(key(slots[0]), values()[0]);
+  }
+
+  CKey_CValue back() const {
+    if (large)
+      return static_cast<queue_type const &>(*large).back();
+    if (entries_size == 0)
+      keyed_queue_fail(this);
+    return CKey_CValue(key(slots[entries_size - 1]), values()[entries_size - 1]);
+  }
+
+  CKey_Value first(K const &k) {
+    if (large)
+      return large->first(k);
+    size_t slot = check_key(k);
+    size_t i = size_t(std::find(slots, slots + entries_size, slot) - slots);
+    return CKey_Value(key(slots[i]), values()[i]);
+  }
+
+  CKey_Value last(K const &k) {
+    if (large)
+      return large->last(k);
+    size_t slot = check_key(k);
+    size_t i = entries_size;
+    while (slots[--i] != slot) {
+    }
+    return CKey_Value(key(slots[i]), values()[i]);
+  }
+
+  CKey_CValue first(K const &k) const {
+    if (large)
+      return static_cast<queue_type const &>(*large).first(k);
+    size_t slot = check_key(k);
+    size_t i = size_t(std::find(slots, slots + entries_size, slot) - slots);
+    return CKey_CValue(key(slots[i]), values()[i]);
+  }
+
+  CKey_CValue last(K const &k) const {
+    if (large)
+      return static_cast<queue_type const &>(*large).last(k);
+    size_t slot = check_key(k);
+    size_t i = entries_size;
+    while (slots[--i] != slot) {
+    }
+    return CKey_CValue(key(slots[i]), values()[i]);
+  }
+
+  size_t size() const noexcept {
+    return large ? large->size() : entries_size;
+  }
+
+  bool empty() const noexcept {
+    return size() == 0;
+  }
+
+  void clear() {
+    large.reset();
+    destroy_small();
+  }
+
+  size_t count(K const &k) const {
+    if (large)
+      return large->count(k);
+    size_t slot = find_key(k);
+    return slot == NK ? 0 : key_counts[slot];
+  }
+
+  // Whether the entries are inline.
+  bool is_small() const noexcept {
+    return !large;
+  }
+
+  Alloc get_allocator() const {
+    return alloc;
+  }
+
+  // Calls f(k, v) for every element, from front to back.
+  template <class F>
+  void for_each(F f) const {
+    if (large) {
+      large->for_each(f);
+      return;
+    }
+    for (size_t i = 0; i < entries_size; ++i)
+      f(key(slots[i]), values()[i]);
+  }
+
+  k_iterator k_begin() const noexcept {
+    if (large)
+      return k_iterator(this, large->k_begin());
+    return k_iterator(this, size_t(0));
+  }
+
+  k_iterator k_end() const noexcept {
+    if (large)
+      return k_iterator(this, large->k_end());
+    return k_iterator(this, size_t(keys_size));
+  }
+
+};
+
+#endif /* SMALL_KEYED_QUEUE_H */
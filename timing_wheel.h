@@ -0,0 +1,121 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <map>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+// Hashed timing wheel of `slots` buckets of one tick each, with an ordered
+// overflow map for items beyond its horizon. Due times are rounded up to
+// whole ticks, so an item is never released early and at most one tick
+// late; items due in the same tick are released in scheduling order.
+template <class T, class Clock = std::chrono::steady_clock>
+class timing_wheel {
+public:
+  using time_point = typename Clock::time_point;
+  using duration = typename Clock::duration;
+
+private:
+  std::vector<std::vector<T>> wheel;
+  std::multimap<uint64_t, T> overflow;
+  duration tick;
+  uint64_t current;
+  size_t pending;
+
+  uint64_t tick_of(time_point t) const {
+    auto since = t.time_since_epoch();
+    if (since.count() <= 0)
+      return 0;
+    return uint64_t(since / tick);
+  }
+
+  uint64_t due_tick(time_point t) const {
+    uint64_t n = tick_of(t);
+    return tick * typename duration::rep(n) < t.time_since_epoch() ? n + 1 : n;
+  }
+
+  // On failure the released prefix is dropped and the rest stays due.
+  template <class F>
+  void release_all(std::vector<T> &slot, F &release) {
+    size_t done = 0;
+    try {
+      for (; done < slot.size(); ++done) {
+        release(slot[done]);
+        --pending;
+      }
+    }
+    catch (...) {
+      slot.erase(slot.begin(), slot.begin() + done);
+      throw;
+    }
+    slot.clear();
+  }
+
+public:
+  explicit timing_wheel(duration t = std::chrono::milliseconds(1), size_t slots = 4096)
+      : wheel(std::max<size_t>(slots, 1)), tick(t > duration::zero() ? t : duration(1)),
+        current(tick_of(Clock::now())), pending(0) {
+  }
+
+  // Whether an item scheduled for when would already be released.
+  bool due(time_point when) const {
+    return due_tick(when) <= current;
+  }
+
+  // Items already due go into the next tick.
+  void schedule(T item, time_point when) {
+    uint64_t t = std::max(due_tick(when), current + 1);
+    if (t <= current + wheel.size())
+      wheel[t % wheel.size()].push_back(std::move(item));
+    else
+      overflow.emplace(t, std::move(item));
+    ++pending;
+  }
+
+  // Calls release(T &) on every item due by now, in due order.
+  template <class F>
+  void advance(time_point now, F release) {
+    uint64_t target = tick_of(now);
+    if (target <= current)
+      return;
+
+    uint64_t last = std::min<uint64_t>(target, current + wheel.size());
+    while (current < last) {
+      release_all(wheel[(current + 1) % wheel.size()], release);
+      ++current;
+    }
+    current = target;
+
+    while (!overflow.empty() && overflow.begin()->first <= current + wheel.size()) {
+      auto it = overflow.begin();
+      if (it->first <= current) {
+        release(it->second);
+        --pending;
+      }
+      else
+        wheel[it->first % wheel.size()].push_back(std::move(it->second));
+      overflow.erase(it);
+    }
+  }
+
+  size_t size() const noexcept {
+    return pending;
+  }
+
+  bool empty() const noexcept {
+    return pending == 0;
+  }
+
+  void clear() noexcept {
+    for (auto &slot : wheel)
+      slot.clear();
+    overflow.clear();
+    pending = 0;
+  }
+};
+
+#endif /* TIMING_WHEEL_H */
@@ -0,0 +1,190 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include "keyed_queue.h"
+#include "keyed_queue_storage.h"
+
+#include <mutex>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+
+// One keyed_queue per worker. A key lives in exactly one worker's queue at a
+// time: its home worker by hash, or the worker that last stole it. Idle
+// workers steal whole keys, so every key is still consumed in the order of a
+// single keyed_queue. All queues share one arena, which lets a steal splice
+// the key's elements over without copying or allocating.
+template <class K, class V, class Hash = std::hash<K>>
+class work_stealing_pool {
+public:
+  using allocator_type = arena_allocator<std::pair<const K, V>>;
+  using queue_type = keyed_queue<K, V, allocator_type>;
+
+private:
+  struct alignas(64) worker {
+    std::mutex mutex;
+    queue_type queue;
+
+    explicit worker(allocator_type const &a) : queue(a) {
+    }
+  };
+
+  std::vector<std::unique_ptr<worker>> workers;
+  Hash hash;
+
+  // Keys that live away from their home worker. Lock order: worker mutexes
+  // (lower index first), then routes_mutex.
+  mutable std::shared_mutex routes_mutex;
+  std::unordered_map<K, size_t, Hash> routes;
+
+  size_t owner_of(K const &k) const {
+    std::shared_lock<std::shared_mutex> lock(routes_mutex);
+    auto it = routes.find(k);
+    return it == routes.end() ? home_of(k) : it->second;
+  }
+
+  // Called with the worker's mutex held once the key has left its queue.
+  void drop_route(size_t w, K const &k) {
+    if (workers[w]->queue.count(k) != 0)
+      return;
+    std::unique_lock<std::shared_mutex> lock(routes_mutex);
+    auto it = routes.find(k);
+    if (it != routes.end() && it->second == w)
+      routes.erase(it);
+  }
+
+public:
+  explicit work_stealing_pool(size_t n, storage_options const &o = storage_options(),
+                              Hash const &h = Hash())
+      : hash(h), routes(0, h) {
+    allocator_type alloc(o);
+    for (size_t i = 0; i < (n == 0 ? 1 : n); ++i)
+      workers.emplace_back(new worker(alloc));
+  }
+
+  work_stealing_pool(work_stealing_pool const &) = delete;
+  work_stealing_pool &operator=(work_stealing_pool const &) = delete;
+
+  size_t worker_count() const noexcept {
+    return workers.size();
+  }
+
+  size_t home_of(K const &k) const {
+    return hash(k) % workers.size();
+  }
+
+  void push(K const &k, V const &v) {
+    for (;;) {
+      size_t w = owner_of(k);
+      std::lock_guard<std::mutex> lock(workers[w]->mutex);
+      if (owner_of(k) != w)
+        continue;
+      workers[w]->queue.push(k, v);
+      return;
+    }
+  }
+
+  // Removes the element pop() would remove from worker w's own queue.
+  bool try_pop(size_t w, K &k, V &v) {
+    std::lock_guard<std::mutex> lock(workers[w]->mutex);
+    queue_type &queue = workers[w]->queue;
+    if (queue.empty())
+      return false;
+    auto entry = static_cast<queue_type const &>(queue).back();
+    k = entry.first;
+    v = entry.second;
+    queue.pop();
+    drop_route(w, k);
+    return true;
+  }
+
+  // Moves one key from the most loaded other worker to the thief: the key
+  // of the victim's front element, the end farthest from where the victim
+  // itself is popping.
+  bool steal(size_t thief) {
+    size_t victim = thief;
+    size_t most = 0;
+    for (size_t i = 0; i < workers.size(); ++i) {
+      if (i == thief)
+        continue;
+      std::lock_guard<std::mutex> lock(workers[i]->mutex);
+      if (workers[i]->queue.size() > most) {
+        most = workers[i]->queue.size();
+        victim = i;
+      }
+    }
+    if (victim == thief)
+      return false;
+
+    worker &first = *workers[std::min(thief, victim)];
+    worker &second = *workers[std::max(thief, victim)];
+    std::lock_guard<std::mutex> first_lock(first.mutex);
+    std::lock_guard<std::mutex> second_lock(second.mutex);
+
+    queue_type &from = workers[victim]->queue;
+    if (from.empty())
+      return false;
+    K k = static_cast<queue_type const &>(from).front().first;
+
+    std::unique_lock<std::shared_mutex> lock(routes_mutex);
+    if (thief == home_of(k)) {
+      from.transfer(k, workers[thief]->queue);
+      routes.erase(k);
+    }
+    else {
+      routes[k] = thief;
+      try {
+        from.transfer(k, workers[thief]->queue);
+      }
+      catch (...) {
+        if (victim == home_of(k))
+          routes.erase(k);
+        else
+          routes[k] = victim;
+        throw;
+      }
+    }
+    return true;
+  }
+
+  bool try_pop_or_steal(size_t w, K &k, V &v) {
+    if (try_pop(w, k, v))
+      return true;
+    return steal(w) && try_pop(w, k, v);
+  }
+
+  // Runs f on worker w's keyed_queue under its lock.
+  template <class F>
+  auto with_worker(size_t w, F &&f) -> decltype(f(std::declval<queue_type &>())) {
+    std::lock_guard<std::mutex> lock(workers[w]->mutex);
+    return f(workers[w]->queue);
+  }
+
+  size_t size(size_t w) const {
+    std::lock_guard<std::mutex> lock(workers[w]->mutex);
+    return workers[w]->queue.size();
+  }
+
+  size_t size() const {
+    size_t total = 0;
+    for (size_t w = 0; w < workers.size(); ++w)
+      total += size(w);
+    return total;
+  }
+
+  size_t count(K const &k) const {
+    for (;;) {
+      size_t w = owner_of(k);
+      std::lock_guard<std::mutex> lock(workers[w]->mutex);
+      if (owner_of(k) == w)
+        return workers[w]->queue.count(k);
+    }
+  }
+};
+
+#endif /* WORK_STEALING_POOL_H */